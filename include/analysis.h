@@ -5,6 +5,7 @@
 #include <include/utils.h>
 
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <vector>
 #include <optional>
@@ -18,22 +19,36 @@ struct CompileTimeError
 using Resolution = std::unordered_map<ExpressionIndex, int>;
 
 // Resolve names to declarations.
+// Whether an analysis visits the bodies of global functions or leaves
+// them to be analyzed separately, e.g., right before their first call.
+enum class FunctionBodies { Analyze, Defer };
+
+// Resolves the local variables to their distance from the scope of
+// the reference. Instances can be reused for later inputs.
 class NameResolver
 {
 public:
     NameResolver(const ASTContext& ctxt, const DiagnosticEmitter& diag) noexcept
         : ctxt(ctxt), diag(diag) {}
-    std::optional<Resolution> resolveVariables(StatementIndex stmt) noexcept;
+    std::optional<Resolution> resolveVariables(StatementIndex stmt,
+                                               FunctionBodies bodies = FunctionBodies::Analyze) noexcept;
+
+    // Resolves the body of a deferred global function. Throws
+    // CompileTimeError instead of reporting the errors.
+    Resolution resolveFunction(const FunDecl& decl);
 
 private:
+    void resolveFunctionBody(const FunDecl* f);
+
     void resolve(ExpressionIndex expr);
     void resolve(StatementIndex stmt);
-    void resolveLocal(ExpressionIndex expr, const std::string& name);
+    void resolveLocal(ExpressionIndex expr, Index<Token> name);
     void resolveStatements(const std::vector<StatementIndex>& statements);
 
-    void declare(Index<Token> tok);
+    void declare(Index<Token> tok, bool isConst = false);
     void define(Index<Token> tok);
-    
+    void resetScopes();
+
     void beginScope();
     void endScope();
 
@@ -66,11 +81,201 @@ private:
     const ASTContext& ctxt;
     const DiagnosticEmitter& diag;
 
-    using Scope = std::unordered_map<std::string, bool>;
-    std::vector<Scope> stack;
+    // Flat symbol table. Every binding points to the binding it
+    // shadows, so the innermost declaration of a symbol is a single
+    // lookup and leaving a scope pops the bindings above its mark.
+    struct Binding
+    {
+        unsigned symbol;
+        unsigned shadowed; // Binding index + 1, zero if none.
+        unsigned depth;
+        bool defined;
+        bool isConst;
+    };
+    const Binding* innermostBinding(Index<Token> tok) const noexcept;
+
+    std::vector<Binding> bindings;
+    std::vector<unsigned> innermost; // Per symbol, binding index + 1.
+    std::vector<unsigned> scopeMarks;
+
+    // Globals are only tracked to reject changing constants. They
+    // are kept between runs, as later inputs of the prompt share
+    // the same globals.
+    std::unordered_set<unsigned> declaredGlobals;
+    std::unordered_set<unsigned> globalConstants;
+
     Resolution resolution;
     ExpressionIndex currentExpr{};
     bool isInFunction = false;
+    FunctionBodies bodies = FunctionBodies::Analyze;
+};
+
+// Names of all the variables assigned to in a statement.
+std::unordered_set<std::string> collectAssignedNames(const ASTContext& ctxt, StatementIndex stmt);
+
+// Name tokens of the local declarations referenced by nested functions.
+// Names are looked up in the order of the statements, like NameResolver
+// does, so compilers can box these locals right at their declarations.
+std::unordered_set<Index<Token>> findCapturedLocals(const ASTContext& ctxt, StatementIndex stmt);
+
+// Finds the global functions that only depend on their arguments.
+// A pure function reads no mutable globals or captured variables,
+// does not print, does not create closures and only calls pure
+// functions. Only meaningful for complete programs, since in the
+// prompt later inputs can rebind any global.
+class PurityAnalysis
+{
+public:
+    explicit PurityAnalysis(const ASTContext& ctxt) noexcept : ctxt(ctxt) {}
+
+    // Returns the name tokens of the pure function declarations.
+    std::unordered_set<Index<Token>> findPureFunctions(StatementIndex stmt);
+
+private:
+    struct FunctionInfo
+    {
+        Index<Token> name;
+        bool pure = true;
+        std::unordered_set<std::string> callees;
+    };
+
+    void check(StatementIndex stmt);
+    void check(ExpressionIndex expr);
+    bool isLocal(const std::string& name) const;
+    bool isImmutableGlobal(const std::string& name) const;
+
+    const ASTContext& ctxt;
+
+    std::unordered_map<std::string, unsigned> globalDeclarations;
+    std::unordered_set<std::string> assignedNames;
+
+    // The state of the function being checked.
+    FunctionInfo* current = nullptr;
+    std::vector<std::unordered_set<std::string>> scopes;
+};
+
+// Types that can be proven statically.
+enum class StaticType : unsigned char
+{
+    None, // Not reached by the analysis.
+    Number,
+    String,
+    Bool,
+    Nil,
+    Unknown
+};
+
+// Operand types proven for the operators, indexed by node id.
+// Operators with operands of different or unknown types map to
+// StaticType::Unknown.
+class TypeFacts
+{
+public:
+    StaticType operandsOf(Index<Binary> b) const noexcept
+    {
+        return b.id < binaryOperands.size() ? binaryOperands[b.id] : StaticType::None;
+    }
+
+    StaticType operandsOf(Index<Unary> u) const noexcept
+    {
+        return u.id < unaryOperands.size() ? unaryOperands[u.id] : StaticType::None;
+    }
+
+    void merge(TypeFacts&& other);
+
+private:
+    std::vector<StaticType> binaryOperands;
+    std::vector<StaticType> unaryOperands;
+
+    friend class TypeInference;
+};
+
+// Flow-sensitive inference of the types of local variables. Successful
+// operations refine the types of their operands, e.g., after `n - 1`
+// evaluates `n` is known to be a number. Globals and locals written by
+// nested functions can change behind our back, so they are not tracked.
+class TypeInference
+{
+public:
+    // Without refinement the facts only rely on the declarations and
+    // assignments, not on the success of earlier operations.
+    explicit TypeInference(const ASTContext& ctxt, bool refineOperands = true) noexcept
+        : ctxt(ctxt), refineOperands(refineOperands) {}
+    TypeFacts inferTypes(StatementIndex stmt, FunctionBodies bodies = FunctionBodies::Analyze);
+    TypeFacts inferTypes(const FunDecl& decl);
+
+private:
+    template<typename Analyze>
+    TypeFacts run(Analyze analyze);
+
+    using TypeState = std::unordered_map<unsigned, StaticType>;
+
+    struct Variable
+    {
+        unsigned id; // The index of the declaring token.
+        unsigned functionDepth;
+    };
+
+    StaticType infer(ExpressionIndex expr);
+    void infer(StatementIndex stmt);
+    void inferStatements(const std::vector<StatementIndex>& statements);
+
+    void declare(Index<Token> tok, StaticType type);
+    std::optional<Variable> lookup(Index<Token> tok) const;
+    bool isTracked(const Variable& var) const;
+    StaticType typeOf(Index<Token> tok) const;
+    void setType(Index<Token> tok, StaticType type);
+    void refine(ExpressionIndex operand, StaticType type);
+
+    static StaticType join(StaticType lhs, StaticType rhs) noexcept;
+    static std::optional<TypeState> join(const std::optional<TypeState>& lhs,
+                                         const std::optional<TypeState>& rhs);
+    static void record(std::vector<StaticType>& facts, unsigned id, StaticType type);
+
+    struct ExprInferVisitor
+    {
+        TypeInference& t;
+        StaticType operator()(Index<Binary> b) const;
+        StaticType operator()(Index<Assign> a) const;
+        StaticType operator()(Index<Unary> u) const;
+        StaticType operator()(Index<Literal> l) const;
+        StaticType operator()(Index<Grouping> g) const;
+        StaticType operator()(Index<DeclRef> r) const;
+        StaticType operator()(Index<Call> c) const;
+    } exprVisitor{*this};
+
+    struct StmtInferVisitor
+    {
+        TypeInference& t;
+        void operator()(const PrintStatement* s) const;
+        void operator()(const ExprStatement* s) const;
+        void operator()(const VarDecl* v) const;
+        void operator()(const FunDecl* f) const;
+        void operator()(const Return* s) const;
+        void operator()(const Block* s) const;
+        void operator()(const IfStatement* s) const;
+        void operator()(const WhileStatement* s) const;
+        void operator()(const Unit* s) const;
+    } stmtVisitor{*this};
+
+    const ASTContext& ctxt;
+    bool refineOperands;
+    FunctionBodies bodies = FunctionBodies::Analyze;
+
+    std::vector<std::unordered_map<std::string, Variable>> scopes;
+    unsigned functionDepth = 0;
+
+    // The state is empty after returns, i.e., the code is unreachable.
+    std::optional<TypeState> state;
+
+    // Counts the assignments inferred so far.
+    unsigned assignments = 0;
+
+    // Locals assigned by nested functions, found by a first run.
+    std::unordered_set<unsigned> escaping;
+    bool collectingEscapes = false;
+
+    TypeFacts facts;
 };
 
 #endif
\ No newline at end of file
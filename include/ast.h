@@ -2,6 +2,8 @@
 #define AST_H
 
 #include <optional>
+#include <string>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 #include <functional>
@@ -67,10 +69,56 @@ using StatementIndex = std::variant<Index<ExprStatement>, Index<PrintStatement>,
                                     Index<FunDecl>, Index<Return>,
                                     Index<Unit>>;
 
+// Operators are decoded from their tokens once, when the nodes are
+// made. Grouped by family: arithmetic (Add also concatenates strings),
+// comparison, equality and logical.
+enum class BinaryOp : unsigned char
+{
+    Add, Subtract, Multiply, Divide,
+    Greater, GreaterEqual, Less, LessEqual,
+    Equal, NotEqual,
+    And, Or
+};
+
+enum class UnaryOp : unsigned char
+{
+    Negate, Not
+};
+
+inline BinaryOp toBinaryOp(TokenType type) noexcept
+{
+    using enum TokenType;
+    switch (type)
+    {
+        case PLUS: return BinaryOp::Add;
+        case MINUS: return BinaryOp::Subtract;
+        case STAR: return BinaryOp::Multiply;
+        case SLASH: return BinaryOp::Divide;
+        case GREATER: return BinaryOp::Greater;
+        case GREATER_EQUAL: return BinaryOp::GreaterEqual;
+        case LESS: return BinaryOp::Less;
+        case LESS_EQUAL: return BinaryOp::LessEqual;
+        case EQUAL_EQUAL: return BinaryOp::Equal;
+        case BANG_EQUAL: return BinaryOp::NotEqual;
+        case AND: return BinaryOp::And;
+        case OR: return BinaryOp::Or;
+        default: break;
+    }
+    assert(false && "Unhandled binary operator");
+    return BinaryOp::Add;
+}
+
+inline UnaryOp toUnaryOp(TokenType type) noexcept
+{
+    assert((type == TokenType::MINUS || type == TokenType::BANG) && "Unhandled unary operator");
+    return type == TokenType::BANG ? UnaryOp::Not : UnaryOp::Negate;
+}
+
 struct Binary
 {
     Index<Token> op;
     ExpressionIndex left, right;
+    BinaryOp kind;
 };
 
 struct Assign
@@ -83,6 +131,7 @@ struct Unary
 {
     Index<Token> op;
     ExpressionIndex subExpr;
+    UnaryOp kind;
 };
 
 struct Literal
@@ -124,6 +173,7 @@ struct VarDecl
 {
     Index<Token> name;
     std::optional<ExpressionIndex> init;
+    bool isConst = false; // Constants are never reassigned.
 };
 
 struct FunDecl
@@ -168,7 +218,7 @@ public:
     // Expression factories.
     Index<Binary> makeBinary(ExpressionIndex left, Index<Token> t, ExpressionIndex right) noexcept
     {
-        return insert_node(binaries, t, left, right);
+        return insert_node(binaries, t, left, right, toBinaryOp(getToken(t).type));
     }
 
     Index<Assign> makeAssign(Index<Token> name, ExpressionIndex value) noexcept
@@ -178,7 +228,7 @@ public:
 
     Index<Unary> makeUnary(Index<Token> t, ExpressionIndex subExpr) noexcept
     {
-        return insert_node(unaries, t, subExpr);
+        return insert_node(unaries, t, subExpr, toUnaryOp(getToken(t).type));
     }
 
     Index<Literal> makeLiteral(Index<Token> t) noexcept
@@ -213,9 +263,9 @@ public:
         return insert_node(exprStmts, subExpr);
     }
 
-    Index<VarDecl> makeVarDecl(Index<Token> name, std::optional<ExpressionIndex> init) noexcept
+    Index<VarDecl> makeVarDecl(Index<Token> name, std::optional<ExpressionIndex> init, bool isConst = false) noexcept
     {
-        return insert_node(varDecls, name, init);
+        return insert_node(varDecls, name, init, isConst);
     }
 
     Index<FunDecl> makeFunDecl(Index<Token> name, std::vector<Index<Token>>&& params, std::vector<StatementIndex>&& body) noexcept
@@ -269,9 +319,34 @@ public:
         return tokens;
     }
 
-    void addTokens(TokenList&& newTokens) noexcept
+    void addTokens(TokenList&& newTokens) noexcept;
+
+    // Tokens for the nodes created by transformations. Only valid
+    // once all the tokens from the source were added.
+    Index<Token> makeSyntheticToken(Token token) noexcept;
+
+    // Identifiers with the same name share a dense id, so analyses
+    // can use vectors instead of hashing the names.
+    unsigned getSymbol(Index<Token> idx) const noexcept
+    {
+        return tokenSymbols[idx.id];
+    }
+
+    unsigned getLiteralCount() const noexcept
+    {
+        return literals.size();
+    }
+
+    unsigned getSymbolCount() const noexcept
+    {
+        return symbolIds.size();
+    }
+
+    std::optional<unsigned> findSymbol(const std::string& name) const noexcept
     {
-        tokens.mergeTokensFrom(std::move(newTokens));
+        if (auto it = symbolIds.find(name); it != symbolIds.end())
+            return it->second;
+        return std::nullopt;
     }
 
 private:
@@ -297,6 +372,11 @@ private:
 
     TokenList                     tokens;
 
+    static constexpr unsigned noSymbol = -1;
+    void internTokensFrom(unsigned first) noexcept;
+    std::vector<unsigned>                        tokenSymbols;
+    std::unordered_map<std::string, unsigned>    symbolIds;
+
     struct GetExprNode
     {
         const ASTContext& ctx;
@@ -0,0 +1,257 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <include/ast.h>
+
+// Instructions are one byte, followed by their operands. Unless noted
+// otherwise the operands are 16 bit wide.
+#define SLOX_OPCODES(X)                                                          \
+    X(CONSTANT)          /* Constant index. */                                   \
+    X(NIL)                                                                       \
+    X(TRUE)                                                                      \
+    X(FALSE)                                                                     \
+    X(POP)                                                                       \
+    X(POPN)              /* Number of values. */                                 \
+    X(GET_LOCAL)         /* Slot. */                                             \
+    X(SET_LOCAL)         /* Slot. */                                             \
+    X(GET_CELL)          /* Slot holding the cell of a captured local. */        \
+    X(SET_CELL)          /* Slot holding the cell of a captured local. */        \
+    X(MAKE_CELL)         /* Slot, its value is moved into a new cell. */         \
+    X(GET_CAPTURE)       /* Index among the captures of the closure. */          \
+    X(SET_CAPTURE)       /* Index among the captures of the closure. */          \
+    X(GET_GLOBAL)        /* Symbol. */                                           \
+    X(SET_GLOBAL)        /* Symbol. */                                           \
+    X(DEFINE_GLOBAL)     /* Symbol. */                                           \
+    X(ADD)                                                                       \
+    X(SUBTRACT)                                                                  \
+    X(MULTIPLY)                                                                  \
+    X(DIVIDE)                                                                    \
+    X(GREATER)                                                                   \
+    X(GREATER_EQUAL)                                                             \
+    X(LESS)                                                                      \
+    X(LESS_EQUAL)                                                                \
+    X(EQUAL)                                                                     \
+    X(NOT)                                                                       \
+    X(NEGATE)                                                                    \
+    X(UNSUPPORTED)       /* Binary operators the runtime rejects. */             \
+    X(PRINT)                                                                     \
+    X(JUMP)              /* Forward offset. */                                   \
+    X(JUMP_IF_FALSE)     /* Forward offset, keeps the condition. */              \
+    X(JUMP_IF_TRUE)      /* Forward offset, keeps the condition. */              \
+    X(POP_JUMP_IF_FALSE) /* Forward offset. */                                   \
+    X(LOOP)              /* Backward offset. */                                  \
+    X(CHECK_CALL)        /* Argument count (8 bit), checks the callee. */        \
+    X(CALL)              /* Argument count (8 bit). */                           \
+    X(CLOSURE)           /* Index among the functions of the chunk. */           \
+    X(RET)
+
+enum class OpCode : std::uint8_t
+{
+#define SLOX_OPCODE_ENUM(name) name,
+    SLOX_OPCODES(SLOX_OPCODE_ENUM)
+#undef SLOX_OPCODE_ENUM
+};
+
+// Heap allocated values, owned by the Heap.
+enum class ObjType : std::uint8_t { String, Closure, Native, Cell };
+
+struct Obj
+{
+    explicit Obj(ObjType type) noexcept : type(type) {}
+    Obj(const Obj&) = delete;
+    Obj& operator=(const Obj&) = delete;
+    virtual ~Obj() = default;
+
+    ObjType type;
+    bool marked = false;
+    Obj* next = nullptr;
+};
+
+// Values are NaN-boxed into 64 bits. Numbers are stored as they are,
+// everything else hides in the payload of a quiet NaN no arithmetic
+// produces. Objects set the sign bit and keep their pointer in the low
+// 48 bits, the other values are small tags.
+class Value
+{
+public:
+    // Undefined marks the globals that were never defined, programs
+    // cannot observe it.
+    enum class Type : std::uint8_t { Undefined, Nil, Bool, Number, Object };
+
+    constexpr Value() noexcept : bits(quietNan | tagUndefined) {}
+
+    static constexpr Value nil() noexcept { return Value{quietNan | tagNil}; }
+    static constexpr Value fromBool(bool b) noexcept { return Value{quietNan | (b ? tagTrue : tagFalse)}; }
+    static constexpr Value fromNumber(double d) noexcept { return Value{std::bit_cast<std::uint64_t>(d)}; }
+    static Value fromObject(Obj* o) noexcept
+    {
+        return Value{signBit | quietNan | reinterpret_cast<std::uintptr_t>(o)};
+    }
+
+    Type getType() const noexcept
+    {
+        if (isNumber())
+            return Type::Number;
+        if (isObject())
+            return Type::Object;
+        switch (bits & ~quietNan)
+        {
+            case tagNil: return Type::Nil;
+            case tagFalse:
+            case tagTrue: return Type::Bool;
+            default: return Type::Undefined;
+        }
+    }
+    bool isUndefined() const noexcept { return bits == (quietNan | tagUndefined); }
+    bool isNil() const noexcept { return bits == (quietNan | tagNil); }
+    bool isBool() const noexcept { return (bits | 1) == (quietNan | tagTrue); }
+    bool isNumber() const noexcept { return (bits & quietNan) != quietNan; }
+    bool isObject() const noexcept { return (bits & (signBit | quietNan)) == (signBit | quietNan); }
+    bool isObject(ObjType t) const noexcept { return isObject() && asObject()->type == t; }
+
+    bool asBool() const noexcept { return bits == (quietNan | tagTrue); }
+    double asNumber() const noexcept { return std::bit_cast<double>(bits); }
+    Obj* asObject() const noexcept { return reinterpret_cast<Obj*>(bits & ~(signBit | quietNan)); }
+
+    bool isTruthy() const noexcept
+    {
+        return bits != (quietNan | tagFalse) && bits != (quietNan | tagNil);
+    }
+
+private:
+    explicit constexpr Value(std::uint64_t bits) noexcept : bits(bits) {}
+
+    static constexpr std::uint64_t signBit = 0x8000000000000000;
+    static constexpr std::uint64_t quietNan = 0x7ffc000000000000;
+    static constexpr std::uint64_t tagUndefined = 0;
+    static constexpr std::uint64_t tagNil = 1;
+    static constexpr std::uint64_t tagFalse = 2;
+    static constexpr std::uint64_t tagTrue = 3;
+
+    std::uint64_t bits;
+};
+
+static_assert(sizeof(Value) == 8);
+
+// Like the strings of the other engines, strings are prefixes of
+// append-only buffers. Concatenating to a string ending at the end of
+// its buffer appends in place, the prefixes of a buffer never change.
+struct ObjString : Obj
+{
+    explicit ObjString(std::string chars) : ObjString(std::make_shared<std::string>(std::move(chars))) {}
+    explicit ObjString(std::shared_ptr<std::string> buffer) noexcept
+        : Obj(ObjType::String), buffer(std::move(buffer)), length(this->buffer->size()) {}
+
+    std::string_view view() const noexcept { return {buffer->data(), length}; }
+
+    std::shared_ptr<std::string> buffer;
+    std::size_t length;
+};
+
+// Captured locals live in cells, so the closures share them with
+// the declaring frame.
+struct ObjCell : Obj
+{
+    explicit ObjCell(Value value) noexcept : Obj(ObjType::Cell), value(value) {}
+    Value value;
+};
+
+struct ObjNative : Obj
+{
+    using Fn = Value (*)(const Value* args);
+    ObjNative(unsigned arity, Fn fn) noexcept : Obj(ObjType::Native), arity(arity), fn(fn) {}
+    unsigned arity;
+    Fn fn;
+};
+
+struct FunctionProto;
+
+struct Chunk
+{
+    std::vector<std::uint8_t> code;
+    std::vector<Value> constants;
+    std::vector<const FunctionProto*> functions;
+
+    // The tokens to report the errors of the instructions that can
+    // fail, ordered by the offsets of the instructions.
+    std::vector<std::pair<unsigned, Index<Token>>> sites;
+
+    // The site of the instruction before the offset.
+    Index<Token> siteBefore(unsigned offset) const noexcept;
+};
+
+struct FunctionProto
+{
+    unsigned arity = 0;
+    unsigned maxStack = 0; // Slots used by a frame, including the callee.
+    Chunk chunk;
+
+    struct Capture
+    {
+        bool fromLocal; // A slot of the enclosing frame or one of its captures.
+        std::uint16_t index;
+    };
+    std::vector<Capture> captures;
+};
+
+struct ObjClosure : Obj
+{
+    explicit ObjClosure(const FunctionProto* proto) noexcept : Obj(ObjType::Closure), proto(proto) {}
+    const FunctionProto* proto;
+    std::vector<ObjCell*> captures;
+};
+
+bool operator==(Value lhs, Value rhs) noexcept;
+std::string print(Value value);
+
+// Owns the objects and the compiled functions. Collection is
+// mark and sweep, the owner marks the roots before calling collect.
+// The constants of the functions are always reachable.
+class Heap
+{
+public:
+    Heap() = default;
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+    ~Heap();
+
+    template<typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        T* result = new T(std::forward<Args>(args)...);
+        result->next = objects;
+        objects = result;
+        ++allocated;
+        return result;
+    }
+
+    FunctionProto* makeProto()
+    {
+        return protos.emplace_back(std::make_unique<FunctionProto>()).get();
+    }
+
+    bool shouldCollect() const noexcept { return allocated > nextCollection; }
+
+    void mark(Value value);
+    void mark(Obj* obj);
+    void collect();
+
+private:
+    void trace(Obj* obj);
+
+    Obj* objects = nullptr;
+    std::vector<Obj*> worklist;
+    std::vector<std::unique_ptr<FunctionProto>> protos;
+    std::size_t allocated = 0;
+    std::size_t nextCollection = 1024;
+};
+
+#endif
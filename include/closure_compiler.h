@@ -0,0 +1,147 @@
+#ifndef CLOSURE_COMPILER_H
+#define CLOSURE_COMPILER_H
+
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <include/analysis.h>
+#include <include/ast.h>
+#include <include/eval.h>
+
+// Compiles resolved statements once into a tree of callables with the
+// operands and operators bound ahead of time. Locals live in the slots
+// of the frames, the locals captured by nested functions in shared
+// cells. Globals are looked up by name once, later through a pointer
+// into the global environment.
+//
+// A function stored in a cell it captures, directly or through other
+// functions, keeps the cell alive. Those cycles are broken by
+// collectCells.
+class ClosureCompiler
+{
+public:
+    using Cell = std::shared_ptr<RuntimeValue>;
+
+    struct Frame
+    {
+        Interpreter& interp;
+        std::vector<RuntimeValue> slots;
+        std::vector<Cell> cells;
+        const std::vector<Cell>& captures;
+        RuntimeValue result{};
+    };
+
+    using CompiledExpr = std::function<RuntimeValue(Frame&)>;
+    // Returns true once a return statement ran.
+    using CompiledStmt = std::function<bool(Frame&)>;
+
+    ClosureCompiler(const ASTContext& ctxt, const DiagnosticEmitter& diag,
+                    Environment& globals, const TypeFacts& typeFacts) noexcept;
+    // Clears the cells, the functions stored in them might outlive the
+    // compiler in the global environment.
+    ~ClosureCompiler();
+
+    // Returns a callable running the statement in the global scope.
+    std::function<void(Interpreter&)> compileScript(StatementIndex stmt);
+
+private:
+    struct Local
+    {
+        unsigned symbol;
+        unsigned depth;
+        bool captured;
+        unsigned index; // Of the slot or the cell.
+    };
+
+    struct Capture
+    {
+        bool fromCell; // A cell of the enclosing frame or one of its captures.
+        unsigned index;
+    };
+
+    struct Function
+    {
+        unsigned arity = 0;
+        unsigned slotCount = 0;
+        unsigned cellCount = 0;
+        std::vector<std::pair<unsigned, unsigned>> boxedParams; // Slot and cell.
+        std::vector<Capture> captures;
+        CompiledStmt body;
+    };
+
+    struct FunctionState
+    {
+        FunctionState* enclosing;
+        std::vector<Local> locals{};
+        std::vector<Capture> captures{};
+        unsigned scopeDepth = 0;
+        unsigned slotCount = 0;
+        unsigned cellCount = 0;
+    };
+
+    enum class Access { Slot, Cell, Capture, Global };
+    struct Variable
+    {
+        Access access;
+        unsigned index;
+    };
+
+    CompiledExpr compile(ExpressionIndex expr);
+    CompiledStmt compile(StatementIndex stmt);
+    CompiledStmt compileStatements(const std::vector<StatementIndex>& statements);
+    CompiledExpr compileFunction(const FunDecl* f);
+
+    Cell makeCell(RuntimeValue value);
+    void collectCells();
+
+    const Local& declareLocal(Index<Token> name);
+    void endScope();
+    bool isGlobalScope() const noexcept;
+    Variable lookup(Index<Token> name);
+    static int findLocal(const FunctionState& state, unsigned symbol) noexcept;
+    static int findCapture(FunctionState& state, unsigned symbol);
+
+    struct ExprCompileVisitor
+    {
+        ClosureCompiler& c;
+        CompiledExpr operator()(Index<Binary> idx) const;
+        CompiledExpr operator()(Index<Assign> idx) const;
+        CompiledExpr operator()(Index<Unary> idx) const;
+        CompiledExpr operator()(Index<Literal> idx) const;
+        CompiledExpr operator()(Index<Grouping> idx) const;
+        CompiledExpr operator()(Index<DeclRef> idx) const;
+        CompiledExpr operator()(Index<Call> idx) const;
+    } exprVisitor{*this};
+
+    struct StmtCompileVisitor
+    {
+        ClosureCompiler& c;
+        CompiledStmt operator()(const PrintStatement* s) const;
+        CompiledStmt operator()(const ExprStatement* s) const;
+        CompiledStmt operator()(const VarDecl* v) const;
+        CompiledStmt operator()(const FunDecl* f) const;
+        CompiledStmt operator()(const Return* s) const;
+        CompiledStmt operator()(const Block* s) const;
+        CompiledStmt operator()(const IfStatement* s) const;
+        CompiledStmt operator()(const WhileStatement* s) const;
+        CompiledStmt operator()(const Unit* s) const;
+    } stmtVisitor{*this};
+
+    const ASTContext& ctxt;
+    std::ostream& out;
+    Environment& globals;
+    const TypeFacts& typeFacts;
+
+    FunctionState* current = nullptr;
+    std::unordered_set<Index<Token>> captured;
+
+    std::vector<std::weak_ptr<RuntimeValue>> cells; // Every cell created.
+    std::size_t collectThreshold = minCollectThreshold;
+    static constexpr std::size_t minCollectThreshold = 1024;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+#include <include/ast.h>
+#include <include/bytecode.h>
+
+// Translates resolved statements to byte code. The locals live in
+// the slots of the frames, the locals captured by nested functions
+// are boxed in cells, globals are addressed by their symbols.
+class Compiler
+{
+public:
+    Compiler(const ASTContext& ctxt, Heap& heap) noexcept : ctxt(ctxt), heap(heap) {}
+
+    // Returns a function without parameters running the statement.
+    // Throws CompileTimeError when the limits of the encoding are
+    // exceeded.
+    const FunctionProto* compileScript(StatementIndex stmt);
+
+private:
+    struct Local
+    {
+        unsigned symbol;
+        unsigned depth;
+        bool captured;
+    };
+
+    struct FunctionState
+    {
+        FunctionProto* proto;
+        FunctionState* enclosing;
+        std::vector<Local> locals{};
+        unsigned scopeDepth = 0;
+        unsigned stackDepth = 0;
+    };
+
+    void compile(ExpressionIndex expr);
+    void compile(StatementIndex stmt);
+    void compileFunction(const FunDecl* f);
+
+    void beginScope();
+    void endScope();
+    void declareLocal(Index<Token> name);
+    bool isGlobalScope() const noexcept;
+
+    enum class Access { Local, Cell, Capture, Global };
+    struct Variable
+    {
+        Access access;
+        std::uint16_t index;
+    };
+    Variable lookup(Index<Token> name);
+    static int findLocal(const FunctionState& state, unsigned symbol) noexcept;
+    static int findCapture(FunctionState& state, unsigned symbol);
+
+    void emit(OpCode op, int stackEffect);
+    void emitByte(std::uint8_t byte);
+    void emitShort(unsigned value);
+    void emitSite(Index<Token> site);
+    unsigned emitJump(OpCode op, int stackEffect);
+    void patchJump(unsigned jump);
+    void emitLoop(unsigned start);
+    void emitConstant(Value value);
+    std::uint16_t checkedShort(std::size_t value, const char* what) const;
+
+    Chunk& chunk() noexcept { return current->proto->chunk; }
+
+    struct ExprCompileVisitor
+    {
+        Compiler& c;
+        void operator()(const Binary* b) const;
+        void operator()(const Assign* a) const;
+        void operator()(const Unary* u) const;
+        void operator()(const Literal* l) const;
+        void operator()(const Grouping* g) const;
+        void operator()(const DeclRef* r) const;
+        void operator()(const Call* c) const;
+    } exprVisitor{*this};
+
+    struct StmtCompileVisitor
+    {
+        Compiler& c;
+        void operator()(const PrintStatement* s) const;
+        void operator()(const ExprStatement* s) const;
+        void operator()(const VarDecl* v) const;
+        void operator()(const FunDecl* f) const;
+        void operator()(const Return* s) const;
+        void operator()(const Block* s) const;
+        void operator()(const IfStatement* s) const;
+        void operator()(const WhileStatement* s) const;
+        void operator()(const Unit* s) const;
+    } stmtVisitor{*this};
+
+    const ASTContext& ctxt;
+    Heap& heap;
+    FunctionState* current = nullptr;
+
+    // Tokens of the local declarations referenced by nested functions.
+    std::unordered_set<Index<Token>> captured;
+    Index<Token> errorSite{0};
+};
+
+#endif
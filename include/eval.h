@@ -1,20 +1,31 @@
 #ifndef EVAL_H
 #define EVAL_H
 
+#include <algorithm>
+#include <cassert>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
 #include <variant>
 #include <vector>
 #include <functional>
 #include <unordered_map>
 #include <unordered_set>
 #include <memory>
+#include <span>
 
 #include <fmt/format.h>
 
 #include <include/ast.h>
 #include <include/utils.h>
+#include <include/analysis.h>
+#include <include/options.h>
 
 class Interpreter;
 class Environment;
+class ClosureCompiler;
 
 // Representing runtime values.
 struct Nil{};
@@ -34,30 +45,399 @@ struct fmt::formatter<Nil>
 };
 inline bool operator==(Nil, Nil) { return true; }
 
-struct Callable;
+// Immutable, reference counted string, copies share the characters.
+// Interned strings are unique, two of them are equal only when they
+// share the characters.
+//
+// Strings are prefixes of append-only buffers. Concatenating to a
+// string ending at the end of its buffer appends in place, so
+// accumulating a string in a loop takes linear time. The prefixes of
+// a buffer never change.
+class String
+{
+public:
+    explicit String(std::string chars);
+    static String intern(const std::string& chars);
 
-// TODO: Add representation of objects.
-using RuntimeValue = std::variant<Nil, Callable, std::string, double, bool>;
+    std::string_view view() const noexcept { return {buffer->chars.data(), length}; }
+    std::size_t size() const noexcept { return length; }
+    std::size_t hash() const noexcept;
 
-struct RuntimeError
+    friend bool operator==(const String& lhs, const String& rhs) noexcept;
+    friend String operator+(const String& lhs, const String& rhs);
+
+private:
+    struct Buffer
+    {
+        std::string chars;
+        bool interned;
+    };
+
+    String(std::shared_ptr<Buffer> buffer, std::size_t length) noexcept
+        : buffer(std::move(buffer)), length(length) {}
+
+    std::shared_ptr<Buffer> buffer;
+    std::size_t length;
+    mutable std::optional<std::size_t> cachedHash;
+};
+
+template <>
+struct fmt::formatter<String> : fmt::formatter<std::string_view>
 {
-    Index<Token> where;
-    std::string message;
+    template <typename FormatContext>
+    auto format(const String& s, FormatContext& ctx) -> decltype(ctx.out())
+    {
+        return fmt::formatter<std::string_view>::format(s.view(), ctx);
+    }
 };
 
-// Using throw to return. (TODO: revise.)
+// Numbers with small integral values are kept as integers. Arithmetic
+// on integers stays in their range or falls back to doubles, so both
+// representations of a value behave the same. Like the values of the
+// VM, a number is a single word: integers are boxed into negative quiet
+// NaNs with the top bits of the payload set, arithmetic only produces
+// the default NaN. The integers are biased, so adding, subtracting and
+// comparing them works on the boxed bits.
+class Number
+{
+public:
+    // Integers in [-integerLimit, integerLimit) are boxed.
+    static constexpr std::int64_t integerLimit = std::int64_t{1} << 49;
+
+    Number(double real) noexcept : bits(std::bit_cast<std::uint64_t>(real)) {}
+
+    // Integral doubles become integers, except for negative zero.
+    static Number fromDouble(double d) noexcept
+    {
+        if (d >= -integerLimit && d < integerLimit && d == std::trunc(d) && !(d == 0 && std::signbit(d)))
+            return boxed(bias + static_cast<std::uint64_t>(static_cast<std::int64_t>(d)));
+        return d;
+    }
+
+    // Only integers have all bits of the tag set.
+    bool isInteger() const noexcept { return bits >= integerTag; }
+    double toDouble() const noexcept
+    {
+        return isInteger() ? static_cast<double>(integer()) : std::bit_cast<double>(bits);
+    }
+
+    // The boxed result is out of range when it wrapped below the tag.
+    friend Number operator+(Number lhs, Number rhs) noexcept
+    {
+        if (bothIntegers(lhs, rhs))
+        {
+            if (auto sum = lhs.bits + rhs.bits - bias; sum >= integerTag)
+                return boxed(sum);
+        }
+        return lhs.toDouble() + rhs.toDouble();
+    }
+
+    friend Number operator-(Number lhs, Number rhs) noexcept
+    {
+        if (bothIntegers(lhs, rhs))
+        {
+            if (auto difference = lhs.bits - rhs.bits + bias; difference >= integerTag)
+                return boxed(difference);
+        }
+        return lhs.toDouble() - rhs.toDouble();
+    }
+
+    friend Number operator*(Number lhs, Number rhs) noexcept
+    {
+        // Products of smaller factors cannot leave the range. The others
+        // are computed as doubles, rounding the same way.
+        if (bothIntegers(lhs, rhs))
+        {
+            auto l = lhs.integer();
+            auto r = rhs.integer();
+            constexpr std::int64_t maxFactor = std::int64_t{1} << 24;
+            if (static_cast<std::uint64_t>(l + maxFactor) < 2 * maxFactor &&
+                static_cast<std::uint64_t>(r + maxFactor) < 2 * maxFactor)
+            {
+                // A zero product of a negative operand is negative zero.
+                auto product = l * r;
+                if (product != 0 || (l >= 0 && r >= 0))
+                    return boxed(bias + static_cast<std::uint64_t>(product));
+            }
+        }
+        return lhs.toDouble() * rhs.toDouble();
+    }
+
+    friend Number operator/(Number lhs, Number rhs) noexcept
+    {
+        if (bothIntegers(lhs, rhs))
+        {
+            auto l = lhs.integer();
+            auto r = rhs.integer();
+            if (r != 0 && l % r == 0 && !(l == 0 && r < 0))
+            {
+                if (auto quotient = bias + static_cast<std::uint64_t>(l / r); quotient >= integerTag)
+                    return boxed(quotient);
+            }
+        }
+        return lhs.toDouble() / rhs.toDouble();
+    }
+
+    friend Number operator-(Number n) noexcept
+    {
+        if (n.isInteger() && n.bits != bias)
+        {
+            if (auto negated = 2 * bias - n.bits; negated >= integerTag)
+                return boxed(negated);
+        }
+        return -n.toDouble();
+    }
+
+    friend bool operator==(Number lhs, Number rhs) noexcept
+    {
+        if (bothIntegers(lhs, rhs))
+            return lhs.bits == rhs.bits;
+        return lhs.toDouble() == rhs.toDouble();
+    }
+
+    // Not ordered by <=>, comparisons involving NaN are all false.
+    friend bool operator<(Number lhs, Number rhs) noexcept
+    {
+        if (bothIntegers(lhs, rhs))
+            return lhs.bits < rhs.bits;
+        return lhs.toDouble() < rhs.toDouble();
+    }
+    friend bool operator>(Number lhs, Number rhs) noexcept { return rhs < lhs; }
+    friend bool operator<=(Number lhs, Number rhs) noexcept
+    {
+        if (bothIntegers(lhs, rhs))
+            return lhs.bits <= rhs.bits;
+        return lhs.toDouble() <= rhs.toDouble();
+    }
+    friend bool operator>=(Number lhs, Number rhs) noexcept { return rhs <= lhs; }
+
+private:
+    static constexpr std::uint64_t integerTag = ~std::uint64_t{0} << 50;
+    static constexpr std::uint64_t bias = integerTag + (std::uint64_t{1} << 49);
+
+    static Number boxed(std::uint64_t bits) noexcept
+    {
+        Number result{0.0};
+        result.bits = bits;
+        return result;
+    }
+
+    static bool bothIntegers(Number lhs, Number rhs) noexcept
+    {
+        return std::min(lhs.bits, rhs.bits) >= integerTag;
+    }
+
+    std::int64_t integer() const noexcept { return static_cast<std::int64_t>(bits - bias); }
+
+    std::uint64_t bits;
+    friend class RuntimeValue;
+};
+
+static_assert(sizeof(Number) == sizeof(double));
+
+// Integers print as the doubles they stand for.
+template <>
+struct fmt::formatter<Number> : fmt::formatter<double>
+{
+    template <typename FormatContext>
+    auto format(Number n, FormatContext& ctx) -> decltype(ctx.out())
+    {
+        return fmt::formatter<double>::format(n.toDouble(), ctx);
+    }
+};
+
+struct FunctionObject;
+
+// Function values are handles, copies share the function.
 struct Callable
 {
-    unsigned arity;
-    Environment* closure;
-    std::function<RuntimeValue(Interpreter&, std::vector<RuntimeValue>&&)> impl;
+    std::shared_ptr<FunctionObject> fn;
+};
 
-    RuntimeValue operator()(Interpreter& interp, std::vector<RuntimeValue> args) const;
+// Values are a single word. Numbers are stored as they are. Nil,
+// booleans and the pointers to the reference counted boxes of strings
+// and functions are positive quiet NaNs with the top bits of the
+// payload set, arithmetic never produces those. The alternatives are
+// accessed like the ones of a variant, indexed in the order below.
+class RuntimeValue
+{
+public:
+    RuntimeValue() noexcept : RuntimeValue(Nil{}) {}
+    RuntimeValue(Nil) noexcept : number(Number::boxed(nilTag)) {}
+    RuntimeValue(bool b) noexcept : number(Number::boxed(boolTag | b)) {}
+    RuntimeValue(Number n) noexcept : number(n) {}
+    RuntimeValue(double d) noexcept : number(d) {}
+    RuntimeValue(String s) : number(Number::boxed(stringTag | address(new Box<String>{{}, std::move(s)}))) {}
+    RuntimeValue(Callable c) : number(Number::boxed(callableTag | address(new Box<Callable>{{}, std::move(c)}))) {}
+
+    RuntimeValue(const RuntimeValue& other) noexcept : number(other.number)
+    {
+        if (isBoxed())
+            ++header()->refs;
+    }
+    RuntimeValue(RuntimeValue&& other) noexcept : number(other.number)
+    {
+        other.number.bits = nilTag;
+    }
+    RuntimeValue& operator=(RuntimeValue other) noexcept
+    {
+        std::swap(number.bits, other.number.bits);
+        return *this;
+    }
+    ~RuntimeValue()
+    {
+        if (isBoxed() && --header()->refs == 0)
+            destroy();
+    }
+
+    // Nil, Callable, String, Number, bool.
+    std::size_t index() const noexcept
+    {
+        if (is<Number>())
+            return 3;
+        switch (number.bits & tagMask)
+        {
+            case nilTag: return 0;
+            case boolTag: return 4;
+            case stringTag: return 2;
+            default: return 1;
+        }
+    }
+
+    template <typename T>
+    bool is() const noexcept
+    {
+        if constexpr (std::is_same_v<T, Number>)
+            return (number.bits & nanMask) != nanTag;
+        else if constexpr (std::is_same_v<T, Nil>)
+            return number.bits == nilTag;
+        else
+            return (number.bits & tagMask) == tagOf<T>();
+    }
+
+    // Unchecked, the value holds a T.
+    template <typename T>
+    decltype(auto) get() const noexcept
+    {
+        assert(is<T>());
+        if constexpr (std::is_same_v<T, Number>)
+            return (number);
+        else if constexpr (std::is_same_v<T, bool>)
+            return (number.bits & 1) != 0;
+        else if constexpr (std::is_same_v<T, Nil>)
+            return Nil{};
+        else
+            return static_cast<const T&>(static_cast<Box<T>*>(header())->value);
+    }
+    template <typename T>
+    T& get() noexcept requires (!std::is_same_v<T, bool> && !std::is_same_v<T, Nil>)
+    {
+        return const_cast<T&>(std::as_const(*this).get<T>());
+    }
+
+    template <typename T>
+    const T* getIf() const noexcept
+    {
+        return is<T>() ? &get<T>() : nullptr;
+    }
+    template <typename T>
+    T* getIf() noexcept
+    {
+        return is<T>() ? &get<T>() : nullptr;
+    }
+
+    template <typename Visitor>
+    auto visit(Visitor&& visitor) const
+    {
+        switch (index())
+        {
+            case 0: return visitor(Nil{});
+            case 1: return visitor(get<Callable>());
+            case 2: return visitor(get<String>());
+            case 3: return visitor(get<Number>());
+            default: return visitor(get<bool>());
+        }
+    }
+
+    // Of the copies sharing the box, one for the values that are not boxed.
+    unsigned useCount() const noexcept
+    {
+        return isBoxed() ? header()->refs : 1;
+    }
+
+    // Like variants, functions are never equal.
+    friend bool operator==(const RuntimeValue& lhs, const RuntimeValue& rhs) noexcept
+    {
+        if (lhs.is<Number>() && rhs.is<Number>())
+            return lhs.number == rhs.number;
+        if (lhs.is<String>() && rhs.is<String>())
+            return lhs.get<String>() == rhs.get<String>();
+        return lhs.sameBits(rhs) && !lhs.is<Callable>();
+    }
+
+private:
+    struct BoxHeader
+    {
+        unsigned refs = 1;
+    };
+
+    template <typename T>
+    struct Box : BoxHeader
+    {
+        T value;
+    };
+
+    static constexpr std::uint64_t nanMask = 0xFFFC'0000'0000'0000;
+    static constexpr std::uint64_t nanTag = 0x7FFC'0000'0000'0000;
+    static constexpr std::uint64_t tagMask = 0xFFFF'0000'0000'0000;
+    static constexpr std::uint64_t nilTag = nanTag;
+    static constexpr std::uint64_t boolTag = 0x7FFD'0000'0000'0000;
+    static constexpr std::uint64_t stringTag = 0x7FFE'0000'0000'0000;
+    static constexpr std::uint64_t callableTag = 0x7FFF'0000'0000'0000;
+    static constexpr std::uint64_t pointerMask = ~tagMask;
+
+    template <typename T>
+    static constexpr std::uint64_t tagOf() noexcept
+    {
+        if constexpr (std::is_same_v<T, bool>)
+            return boolTag;
+        else if constexpr (std::is_same_v<T, String>)
+            return stringTag;
+        else
+            return callableTag;
+    }
+
+    static std::uint64_t address(BoxHeader* box) noexcept
+    {
+        return reinterpret_cast<std::uintptr_t>(box);
+    }
+
+    bool sameBits(const RuntimeValue& other) const noexcept { return number.bits == other.number.bits; }
+    bool isBoxed() const noexcept { return number.bits >= stringTag && number.bits < (std::uint64_t{1} << 63); }
+    BoxHeader* header() const noexcept { return reinterpret_cast<BoxHeader*>(number.bits & pointerMask); }
+    void destroy() noexcept;
+
+    Number number;
 };
 
-struct ReturnValue
+static_assert(sizeof(RuntimeValue) == sizeof(double));
+
+struct RuntimeError
 {
-    std::optional<RuntimeValue> value;
+    Index<Token> where;
+    std::string message;
+};
+
+// How the evaluation of a statement completed. A return leaves its
+// value in the interpreter, the enclosing statements stop and pass the
+// completion on until the call takes the value. A tail call leaves the
+// callee and its arguments on the value stack instead, the call runs
+// them in place of the returning function.
+enum class Completion : unsigned char
+{
+    Normal,
+    Return,
+    TailCall
 };
 
 template <>
@@ -78,7 +458,89 @@ inline bool operator==(const Callable&, const Callable&) { return false; }
 
 std::string print(const RuntimeValue&);
 
-using Resolution = std::unordered_map<ExpressionIndex, int>;
+// The value denoted by a literal token.
+RuntimeValue literalValue(const Token& token);
+
+// Bounded cache for the results of a pure function. The entries
+// are selected by the hash of the arguments, colliding argument
+// tuples evict each other.
+class MemoTable
+{
+public:
+    // Returns nothing for arguments that cannot be used as keys.
+    static std::optional<std::size_t> hashArguments(std::span<const RuntimeValue> args) noexcept;
+
+    const RuntimeValue* find(std::span<const RuntimeValue> args, std::size_t hash) const noexcept;
+    void insert(std::vector<RuntimeValue> args, std::size_t hash, RuntimeValue result);
+
+    static constexpr std::size_t capacity = 1024;
+
+private:
+
+    struct Entry
+    {
+        std::size_t hash;
+        std::vector<RuntimeValue> args;
+        RuntimeValue result;
+    };
+    std::vector<std::optional<Entry>> entries;
+};
+
+// User functions run their declaration in the interpreter. Natives are
+// plain function pointers, the functions of the closure engine are
+// compiled into function objects.
+struct FunctionObject
+{
+    // The arguments can be moved from.
+    using Native = RuntimeValue (*)(Interpreter&, std::span<RuntimeValue>);
+    using Compiled = std::function<RuntimeValue(Interpreter&, std::span<RuntimeValue>)>;
+
+    unsigned arity;
+    Environment* closure;
+    const FunDecl* decl = nullptr;
+    Native native = nullptr;
+    Compiled compiled{};
+
+    // Bodies of lazily resolved functions are resolved on the first call.
+    bool resolved = true;
+    std::unique_ptr<MemoTable> memo{}; // Only for pure functions.
+    std::vector<std::shared_ptr<RuntimeValue>> cells{}; // Captured by compiled functions.
+};
+
+// Operand types observed by an operator node. Operators start out
+// unseen, the first evaluation specializes them to the types of their
+// operands and a later mismatch makes them generic for good.
+enum class Quickening : unsigned char
+{
+    Unseen,
+    Number,
+    String,
+    Generic
+};
+
+// Operands of a binary operator read in place instead of through a
+// visit. Planned on the first evaluation of the operator, after its
+// operands are resolved.
+struct FusedOperand
+{
+    enum class Kind : unsigned char
+    {
+        Node,     // Evaluated as usual.
+        Variable, // Read at the distance, -1 for globals.
+        Number    // A number literal.
+    };
+    Kind kind = Kind::Node;
+    int distance = -1;
+    Index<Token> name{0};
+    Number number = 0.0;
+};
+
+struct Fusion
+{
+    bool planned = false;
+    FusedOperand left;
+    FusedOperand right;
+};
 
 // TODO: overhaul environment so each variable has a unique index
 //       instead of relying on names.
@@ -87,40 +549,55 @@ class Environment
 public:
     explicit Environment(Environment* enclosing = nullptr) noexcept : enclosing(enclosing) {}
 
-    void define(const std::string& name, const RuntimeValue& value) noexcept
+    void define(const std::string& name, RuntimeValue value) noexcept
     {
-        values.insert_or_assign(name, value);
+        values.insert_or_assign(name, std::move(value));
     }
 
-    bool assign(const std::string& name, const RuntimeValue& value) noexcept
+    bool assign(const std::string& name, RuntimeValue value) noexcept
     {
         if (auto it = values.find(name); it != values.end())
         {
-            it->second = value;
+            it->second = std::move(value);
             return true;
         }
 
         return false;
     }
 
-    bool assignAt(int distance, const std::string& name, const RuntimeValue& value) noexcept
+    bool assignAt(int distance, const std::string& name, RuntimeValue value) noexcept
     {
-        return ancestor(distance)->assign(name, value);
+        return ancestor(distance)->assign(name, std::move(value));
     }
 
-    std::optional<RuntimeValue> get(const std::string& name) const noexcept
+    const RuntimeValue* get(const std::string& name) const noexcept
     {
         if (auto it = values.find(name); it != values.end())
-            return it->second;
+            return &it->second;
 
-        return std::nullopt; 
+        return nullptr;
     }
 
-    std::optional<RuntimeValue> getAt(int distance, const std::string& name) const noexcept
+    const RuntimeValue* getAt(int distance, const std::string& name) const noexcept
     {
         return ancestor(distance)->get(name);
     }
 
+    // Values are never removed, the result stays valid as long as
+    // the environment.
+    RuntimeValue* find(const std::string& name) noexcept
+    {
+        if (auto it = values.find(name); it != values.end())
+            return &it->second;
+
+        return nullptr;
+    }
+
+    RuntimeValue* findAt(int distance, const std::string& name) noexcept
+    {
+        return ancestor(distance)->find(name);
+    }
+
 private:
     Environment* ancestor(int distance) const noexcept
     {
@@ -137,22 +614,49 @@ private:
     friend Interpreter;
 };
 
+// The default limit of the nested calls of the tree walker and the
+// closure engine, derived from the size of the native stack they
+// recurse on. Deeper recursion needs the VM.
+unsigned maxNativeCallDepth() noexcept;
+
 // Evaluation logic.
 class Interpreter
 {
 public:
-    Interpreter(const ASTContext& ctxt, const DiagnosticEmitter& diag, Environment env = Environment{});
+    Interpreter(const ASTContext& ctxt, const DiagnosticEmitter& diag,
+                Options options = {}, Environment env = Environment{});
+    ~Interpreter();
 
     bool evaluate(StatementIndex stmt);
+    // Fails with a stack overflow at the site of the call when the
+    // calls are nested too deep.
+    RuntimeValue call(FunctionObject& fn, std::span<RuntimeValue> args, Index<Token> site);
 
     const ASTContext& getContext() const noexcept { return ctxt; }
     Environment& getGlobalEnv() noexcept { return globalEnv; }
     Environment& getCurrentEnv() noexcept { return stack.empty() ? getGlobalEnv() : *stack.back(); }
 private:
     RuntimeValue eval(ExpressionIndex expr);
-    void eval(StatementIndex stmt);
+    Completion eval(StatementIndex stmt);
+
+    void resolveFunction(const FunDecl& decl);
+    RuntimeValue invoke(FunctionObject& fn, std::span<RuntimeValue> args);
+    std::size_t pushCall(const Call& c, Index<Call> idx);
+    RuntimeValue finishCall(std::size_t base, Index<Token> site);
+    RuntimeValue callDeclared(const FunctionObject& fn, std::span<RuntimeValue> args);
+    void materializeLiterals();
 
     static bool isTruthy(const RuntimeValue& val);
+    static Quickening& quickeningOf(std::vector<Quickening>& states, unsigned id);
+    Fusion fusionOf(Index<Binary> idx, const Binary& b);
+    FusedOperand planOperand(ExpressionIndex expr) const;
+    RuntimeValue evalOperand(const FusedOperand& operand, ExpressionIndex expr);
+    int assignDistanceOf(Index<Assign> idx);
+    RuntimeValue& assignTarget(const Assign& a, Index<Assign> idx);
+    int distanceOf(ExpressionIndex expr) const noexcept;
+    int refDistanceOf(Index<DeclRef> idx);
+    RuntimeValue readVariable(Index<Token> name, int distance);
+    const RuntimeValue& readGlobal(Index<Token> name);
     static void checkNumberOperand(const RuntimeValue& val, Index<Token> token);
     Environment* pushEnv(Environment* current);
     void popEnv();
@@ -160,10 +664,36 @@ private:
 
     const ASTContext& ctxt;
     const DiagnosticEmitter& diag;
+    Options options;
 
     Environment globalEnv;
     std::vector<Environment*> stack;
+    std::vector<RuntimeValue> valueStack; // Arguments of the pending calls.
+    RuntimeValue returnValue; // Set by the last return statement.
+    std::size_t tailCallBase = 0; // Of the callee set by the last tail call.
+    unsigned callDepth = 0;
+    unsigned maxCallDepth;
+    std::uintptr_t stackBase = 0; // Of the native stack, when the evaluation started.
+    std::size_t stackBudget;
+    NameResolver resolver;
     Resolution resolution;
+    TypeFacts typeFacts;
+    std::unordered_set<Index<Token>> pureFunctions;
+    std::unordered_set<Index<Token>> resolvedFunctions;
+    std::unique_ptr<ClosureCompiler> closureCompiler;
+
+    // Indexed by node ids.
+    std::vector<Quickening> binaryQuickening;
+    std::vector<Quickening> unaryQuickening;
+    std::vector<Fusion> binaryFusions;
+    std::vector<RuntimeValue> literalPool;
+    std::vector<int> assignDistances; // Unplanned entries are below -1.
+    std::vector<int> refDistances; // Unplanned entries are below -1.
+    std::vector<const FunDecl*> checkedCallees; // Last declared callee of the call.
+
+    // Indexed by the names of the references, null until the global is
+    // found. Globals are never removed, the cells stay valid.
+    std::vector<RuntimeValue*> globalCells;
 
     std::unordered_set<std::unique_ptr<Environment>> allEnvs;
     unsigned collectCounter;
@@ -185,15 +715,15 @@ private:
     struct StmtEvalVisitor
     {
         Interpreter& i;
-        void operator()(const PrintStatement* s) const;
-        void operator()(const ExprStatement* s) const;
-        void operator()(const VarDecl* s) const;
-        void operator()(const FunDecl* s) const;
-        void operator()(const Return* s) const;
-        void operator()(const Block* s) const;
-        void operator()(const IfStatement* s) const;
-        void operator()(const WhileStatement* s) const;
-        void operator()(const Unit* s) const;
+        Completion operator()(const PrintStatement* s) const;
+        Completion operator()(const ExprStatement* s) const;
+        Completion operator()(const VarDecl* s) const;
+        Completion operator()(const FunDecl* s) const;
+        Completion operator()(const Return* s) const;
+        Completion operator()(const Block* s) const;
+        Completion operator()(const IfStatement* s) const;
+        Completion operator()(const WhileStatement* s) const;
+        Completion operator()(const Unit* s) const;
     } stmtVisitor{*this};
 };
 
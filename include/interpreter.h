@@ -5,13 +5,15 @@
 #include <string>
 #include <iosfwd>
 
-bool runFile(std::string_view path, bool dumpAst = false);
-bool runFile(std::string_view path, std::ostream& out, std::ostream& err, bool dumpAst = false);
+#include <include/options.h>
 
-bool runSource(std::string sourceText, bool dumpAst = false);
-bool runSource(std::string sourceText, std::ostream& out, std::ostream& err, bool dumpAst = false);
+bool runFile(std::string_view path, const Options& options = {});
+bool runFile(std::string_view path, std::ostream& out, std::ostream& err, const Options& options = {});
 
-bool runPrompt(bool dumpAst = false);
-bool runPrompt(std::istream& in, std::ostream& out, std::ostream& err, bool dumpAst = false);
+bool runSource(std::string sourceText, const Options& options = {});
+bool runSource(std::string sourceText, std::ostream& out, std::ostream& err, const Options& options = {});
+
+bool runPrompt(const Options& options = {});
+bool runPrompt(std::istream& in, std::ostream& out, std::ostream& err, const Options& options = {});
 
 #endif
\ No newline at end of file
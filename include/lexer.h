@@ -27,7 +27,7 @@ enum class TokenType : unsigned char
     IDENTIFIER, STRING, NUMBER,
 
     // Keywords.
-    AND, CLASS, ELSE, FALSE, FUN, FOR, IF, NIL, OR,
+    AND, CLASS, CONST, ELSE, FALSE, FUN, FOR, IF, NIL, OR,
     PRINT, RET, SUPER, THIS, TRUE, VAR, WHILE,
 
     END_OF_FILE
@@ -63,6 +63,7 @@ constexpr std::string_view tokenTypeToSourceName(TokenType type)
         case NUMBER: return "NUMBER";
         case AND: return "and";
         case CLASS: return "class";
+        case CONST: return "const";
         case ELSE: return "else";
         case FALSE: return "false";
         case FUN: return "fun";
@@ -122,6 +123,7 @@ public:
 
     Token& operator[](unsigned i) noexcept { return tokens[i]; }
     const Token& operator[](unsigned i) const noexcept { return tokens[i]; }
+    unsigned size() const noexcept { return tokens.size(); }
 
     std::span<Token> getSourceTokens() noexcept { return {tokens.begin() + firstNonSynthetic, tokens.end()}; }
 
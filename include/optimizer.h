@@ -0,0 +1,119 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <include/ast.h>
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Rebuilds the tree bottom-up giving the passes a chance to
+// replace nodes. Subtrees without changes keep their indices,
+// new nodes are appended to the context.
+//
+// Passes run before name resolution, so the rewriter tracks the
+// local scopes itself, mirroring the rules of NameResolver.
+class ASTRewriter
+{
+public:
+    explicit ASTRewriter(ASTContext& ctxt) noexcept : ctxt(ctxt) {}
+    ASTRewriter(const ASTRewriter&) = delete;
+    ASTRewriter& operator=(const ASTRewriter&) = delete;
+    virtual ~ASTRewriter() = default;
+
+    virtual ExpressionIndex rewrite(ExpressionIndex expr);
+    virtual StatementIndex rewrite(StatementIndex stmt);
+
+protected:
+    ExpressionIndex rewriteChildren(ExpressionIndex expr);
+    StatementIndex rewriteChildren(StatementIndex stmt);
+
+    // Returns true for names declared and initialized in one of
+    // the enclosing local scopes.
+    bool isDefinedLocal(const std::string& name) const noexcept;
+    bool isLocal(const std::string& name) const noexcept;
+    // The name token of the innermost local declaration.
+    std::optional<Index<Token>> localDeclaration(const std::string& name) const noexcept;
+    bool isGlobalScope() const noexcept { return scopes.empty(); }
+
+    const std::string& nameOf(Index<Token> tok) const noexcept
+    {
+        return std::get<std::string>(ctxt.getToken(tok).value);
+    }
+
+    ASTContext& ctxt;
+
+private:
+    void beginScope() { scopes.emplace_back(); }
+    void endScope() { scopes.pop_back(); }
+    void declare(Index<Token> tok);
+    void define(Index<Token> tok);
+
+    struct LocalBinding
+    {
+        Index<Token> declaration;
+        bool defined;
+    };
+    using Scope = std::unordered_map<std::string, LocalBinding>;
+    std::vector<Scope> scopes;
+
+    struct ExprRewriteVisitor
+    {
+        ASTRewriter& r;
+        ExpressionIndex operator()(Index<Binary> idx) const;
+        ExpressionIndex operator()(Index<Assign> idx) const;
+        ExpressionIndex operator()(Index<Unary> idx) const;
+        ExpressionIndex operator()(Index<Literal> idx) const { return idx; }
+        ExpressionIndex operator()(Index<Grouping> idx) const;
+        ExpressionIndex operator()(Index<DeclRef> idx) const { return idx; }
+        ExpressionIndex operator()(Index<Call> idx) const;
+    } exprVisitor{*this};
+
+    struct StmtRewriteVisitor
+    {
+        ASTRewriter& r;
+        StatementIndex operator()(Index<PrintStatement> idx) const;
+        StatementIndex operator()(Index<ExprStatement> idx) const;
+        StatementIndex operator()(Index<VarDecl> idx) const;
+        StatementIndex operator()(Index<FunDecl> idx) const;
+        StatementIndex operator()(Index<Return> idx) const;
+        StatementIndex operator()(Index<Block> idx) const;
+        StatementIndex operator()(Index<IfStatement> idx) const;
+        StatementIndex operator()(Index<WhileStatement> idx) const;
+        StatementIndex operator()(Index<Unit> idx) const;
+    } stmtVisitor{*this};
+
+    std::vector<StatementIndex> rewriteStatements(const std::vector<StatementIndex>& statements, bool& changed);
+};
+
+// Replaces calls to small, non-recursive global functions that are
+// never reassigned with the body of the callee. Only functions with
+// a single return statement are inlined and only at call sites with
+// trivial arguments (literals or initialized variables), so the
+// arguments can be substituted for the parameters directly.
+Index<Unit> inlineCalls(ASTContext& ctxt, Index<Unit> unit);
+
+// Moves the loop invariant sub-expressions of while loops into
+// temporaries declared right before the loop. Expressions reading
+// initialized locals that cannot fail are computed before the loop,
+// even for loops that never run. Arithmetic that might fail is
+// computed the first time it runs, so errors are reported where they
+// used to be.
+Index<Unit> hoistLoopInvariants(ASTContext& ctxt, Index<Unit> unit);
+
+// Replaces the references to constants initialized with compile time
+// constant values by literals and folds the operators with literal
+// operands that cannot fail. Optionally removes the branches with
+// literal conditions that cannot run, the static errors in them are
+// lost, so the program should be resolved before.
+Index<Unit> propagateConstants(ASTContext& ctxt, Index<Unit> unit, bool pruneBranches = true);
+
+// Redirects the calls to global functions with some literal arguments
+// to clones of the callee specialized for those arguments. The clones
+// are simplified by constant propagation and optionally by branch
+// pruning. Functions are cloned a bounded number of times, equal
+// argument lists share the clones.
+Index<Unit> specializeCalls(ASTContext& ctxt, Index<Unit> unit, bool pruneBranches = true);
+
+#endif
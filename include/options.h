@@ -0,0 +1,43 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+// The engines other than the tree walker always resolve functions
+// eagerly and never memoize them.
+enum class Engine
+{
+    TreeWalker,
+
+    // Compiles the resolved program to closures bound to their operands.
+    Closures,
+
+    // Compiles the resolved program to byte code.
+    VM
+};
+
+// Configuration of the interpreter, set from the command line.
+struct Options
+{
+    Engine engine = Engine::TreeWalker;
+
+    bool dumpAst = false;
+
+    // Cache the results of pure functions per argument tuple.
+    bool memoizePure = false;
+
+    // Resolve the bodies of global functions on their first call.
+    // Errors in the body are reported when it is called.
+    bool lazyResolve = false;
+
+    // Clone functions for the literal arguments of their calls.
+    bool specialize = false;
+
+    // Only report the static errors of the program, do not run it.
+    bool checkOnly = false;
+
+    // Calls nested deeper fail with a stack overflow. Zero picks the
+    // limit of the engine. The tree walker and the closure engine
+    // recurse on the native stack, deeper recursion needs the VM.
+    unsigned maxCallDepth = 0;
+};
+
+#endif
@@ -21,12 +21,14 @@ public:
     void addTokens(TokenList tokens);
 
     const ASTContext& getContext() const { return context; }
+    ASTContext& getContext() { return context; }
 
 private:
     // Statements.
     std::optional<StatementIndex> declaration();
     std::optional<Index<FunDecl>> funDeclaration();
     std::optional<Index<VarDecl>> varDeclaration();
+    std::optional<Index<VarDecl>> constDeclaration();
     std::optional<StatementIndex> statement();
     std::optional<StatementIndex> forStatement();
     std::optional<Index<IfStatement>> ifStatement();
@@ -0,0 +1,54 @@
+#ifndef VM_H
+#define VM_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <include/analysis.h>
+#include <include/ast.h>
+#include <include/bytecode.h>
+#include <include/compiler.h>
+#include <include/utils.h>
+
+// Runs the byte code of the compiled inputs on a value stack. Lox
+// calls push frames instead of recursing on the native stack, so the
+// depth of the calls is only bounded by the limit. The inputs share
+// the globals, so instances can be used by the prompt.
+class VM
+{
+public:
+    VM(const ASTContext& ctxt, const DiagnosticEmitter& diag, unsigned maxCallDepth = 0);
+
+    bool evaluate(StatementIndex stmt);
+
+private:
+    struct CallFrame
+    {
+        ObjClosure* closure;
+        const std::uint8_t* ip; // Saved while calling other functions.
+        std::size_t base;       // The slot of the callee.
+    };
+
+    void run(const FunctionProto* script);
+    void defineNatives();
+    void collect(const Value* top);
+
+    [[noreturn]] void fail(const std::uint8_t* ip, std::string message) const;
+    [[noreturn]] void failUndefined(const std::uint8_t* ip) const;
+
+    const ASTContext& ctxt;
+    const DiagnosticEmitter& diag;
+
+    Heap heap;
+    NameResolver resolver;
+    Compiler compiler;
+
+    std::vector<Value> globals; // Indexed by symbols.
+    std::vector<Value> stack;
+    std::vector<CallFrame> frames;
+    std::size_t maxFrames;
+    bool nativesDefined = false;
+};
+
+#endif
@@ -1,6 +1,9 @@
+#include <charconv>
+#include <cstring>
 #include <string_view>
 
 #include <fmt/format.h>
+#include <include/eval.h>
 #include <include/interpreter.h>
 
 using namespace std::literals;
@@ -12,11 +15,17 @@ int main(int argc, const char* argv[])
         fmt::print("Usage: {} [script] [options]\n", argv[0]);
         fmt::print("options:\n");
         fmt::print("  --ast-dump\n");
+        fmt::print("  --memoize-pure\n");
+        fmt::print("  --lazy-resolve\n");
+        fmt::print("  --specialize\n");
+        fmt::print("  --check\n");
+        fmt::print("  --engine=tree|closure|vm\n");
+        fmt::print("  --max-depth=<calls> (deep recursion needs --engine=vm)\n");
         fmt::print("  --help\n");
     };
 
     const char *file = nullptr;
-    bool dumpAst = false;
+    Options options;
     for (int i = 1; i < argc; ++i)
     {
         if (argv[i][0] == '-')
@@ -24,9 +33,51 @@ int main(int argc, const char* argv[])
             // Process flags.
             if (argv[i] == "--ast-dump"sv)
             {
-                dumpAst = true;
+                options.dumpAst = true;
                 continue;
             }
+            if (argv[i] == "--memoize-pure"sv)
+            {
+                options.memoizePure = true;
+                continue;
+            }
+            if (argv[i] == "--lazy-resolve"sv)
+            {
+                options.lazyResolve = true;
+                continue;
+            }
+            if (argv[i] == "--specialize"sv)
+            {
+                options.specialize = true;
+                continue;
+            }
+            if (argv[i] == "--check"sv)
+            {
+                options.checkOnly = true;
+                continue;
+            }
+            if (argv[i] == "--engine=tree"sv)
+            {
+                options.engine = Engine::TreeWalker;
+                continue;
+            }
+            if (argv[i] == "--engine=closure"sv)
+            {
+                options.engine = Engine::Closures;
+                continue;
+            }
+            if (argv[i] == "--engine=vm"sv)
+            {
+                options.engine = Engine::VM;
+                continue;
+            }
+            if (std::string_view flag = argv[i]; flag.starts_with("--max-depth="sv))
+            {
+                auto digits = flag.substr("--max-depth="sv.size());
+                auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), options.maxCallDepth);
+                if (ec == std::errc{} && end == digits.data() + digits.size())
+                    continue;
+            }
             if (argv[i] == "--help"sv)
             {
                 printHelp();
@@ -46,8 +97,14 @@ int main(int argc, const char* argv[])
         return EXIT_FAILURE;
     }
 
+    if (options.engine != Engine::VM && options.maxCallDepth > maxNativeCallDepth())
+    {
+        fmt::print(stderr, "--max-depth above {} needs --engine=vm.\n", maxNativeCallDepth());
+        return EXIT_FAILURE;
+    }
+
     if (file)
-        return runFile(file, dumpAst) ? EXIT_SUCCESS : EXIT_FAILURE;
+        return runFile(file, options) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-    return runPrompt(dumpAst) ? EXIT_SUCCESS : EXIT_FAILURE;
+    return runPrompt(options) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
\ No newline at end of file
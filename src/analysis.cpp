@@ -2,6 +2,8 @@
 
 #include <fmt/format.h>
 
+#include <algorithm>
+
 #include <include/utils.h>
 
 // TODO: implement more analyses:
@@ -10,20 +12,55 @@
 // * Definitive initialization?
 // * After break is implemented: check whether it is inside a loop.
 
-std::optional<Resolution> NameResolver::resolveVariables(StatementIndex stmt) noexcept
+std::optional<Resolution> NameResolver::resolveVariables(StatementIndex stmt, FunctionBodies bodies) noexcept
 {
+    this->bodies = bodies;
+    innermost.resize(ctxt.getSymbolCount(), 0);
+    resolution.clear();
+
+    // Functions might assign constants declared after them.
+    if (const auto* unit = std::get_if<Index<Unit>>(&stmt))
+    {
+        for (auto decl : std::get<const Unit*>(ctxt.getNode(*unit))->statements)
+        {
+            const auto* var = std::get_if<Index<VarDecl>>(&decl);
+            if (!var)
+                continue;
+            const auto* node = std::get<const VarDecl*>(ctxt.getNode(*var));
+            if (node->isConst)
+                globalConstants.insert(ctxt.getSymbol(node->name));
+        }
+    }
+
     try
     {
         resolve(stmt);
-        return resolution;
+        return std::move(resolution);
     }
     catch(const CompileTimeError& e)
     {
+        resetScopes();
         diag.error(ctxt.getToken(e.where).line, e.message);
         return std::nullopt;
     }
 }
 
+Resolution NameResolver::resolveFunction(const FunDecl& decl)
+{
+    innermost.resize(ctxt.getSymbolCount(), 0);
+    resolution.clear();
+    try
+    {
+        resolveFunctionBody(&decl);
+    }
+    catch(const CompileTimeError&)
+    {
+        resetScopes();
+        throw;
+    }
+    return std::move(resolution);
+}
+
 void NameResolver::resolve(ExpressionIndex expr)
 {
     currentExpr = expr;
@@ -37,16 +74,16 @@ void NameResolver::resolve(StatementIndex stmt)
     std::visit(stmtVisitor, node);
 }
 
-void NameResolver::resolveLocal(ExpressionIndex expr, const std::string& name)
+const NameResolver::Binding* NameResolver::innermostBinding(Index<Token> tok) const noexcept
 {
-    for(int i = static_cast<int>(stack.size()) - 1; i >= 0; --i)
-    {
-        if (auto it = stack[i].find(name); it != stack[i].end())
-        {
-            resolution.insert(std::make_pair(expr, stack.size() - 1 - i));
-            return;
-        }
-    }
+    unsigned binding = innermost[ctxt.getSymbol(tok)];
+    return binding ? &bindings[binding - 1] : nullptr;
+}
+
+void NameResolver::resolveLocal(ExpressionIndex expr, Index<Token> name)
+{
+    if (const auto* binding = innermostBinding(name))
+        resolution.insert(std::make_pair(expr, scopeMarks.size() - binding->depth));
 }
 
 void NameResolver::resolveStatements(const std::vector<StatementIndex>& statements)
@@ -57,37 +94,62 @@ void NameResolver::resolveStatements(const std::vector<StatementIndex>& statemen
 
 void NameResolver::beginScope()
 {
-    stack.emplace_back();
+    scopeMarks.push_back(bindings.size());
 }
 
 void NameResolver::endScope()
 {
-    stack.pop_back();
+    while (bindings.size() > scopeMarks.back())
+    {
+        const auto& binding = bindings.back();
+        innermost[binding.symbol] = binding.shadowed;
+        bindings.pop_back();
+    }
+    scopeMarks.pop_back();
 }
 
-void NameResolver::declare(Index<Token> tok)
+void NameResolver::declare(Index<Token> tok, bool isConst)
 {
-    if (stack.empty())
-        return;
+    unsigned symbol = ctxt.getSymbol(tok);
+    bool redeclared = false;
+    if (scopeMarks.empty())
+    {
+        // Globals can be redeclared, unless they are constants.
+        redeclared = !declaredGlobals.insert(symbol).second &&
+                     (isConst || globalConstants.contains(symbol));
+    }
+    else
+    {
+        const auto* previous = innermostBinding(tok);
+        redeclared = previous && previous->depth == scopeMarks.size();
+    }
 
-    const auto& token = ctxt.getToken(tok);
-    auto result = stack.back().insert(std::make_pair(std::get<std::string>(token.value),
-                                                     false));
-    if (!result.second)
+    if (redeclared)
     {
-        const auto& name = std::get<std::string>(token.value);
+        const auto& name = std::get<std::string>(ctxt.getToken(tok).value);
         throw CompileTimeError{tok, fmt::format("Already a variable with name '{}' in this scope.", name)};
     }
+
+    if (scopeMarks.empty())
+        return;
+
+    bindings.push_back({symbol, innermost[symbol], static_cast<unsigned>(scopeMarks.size()), false, isConst});
+    innermost[symbol] = bindings.size();
+}
+
+void NameResolver::resetScopes()
+{
+    while (!scopeMarks.empty())
+        endScope();
+    isInFunction = false;
 }
 
 void NameResolver::define(Index<Token> tok)
 {
-    if (stack.empty())
+    if (scopeMarks.empty())
         return;
 
-    const auto& token = ctxt.getToken(tok);
-    stack.back().insert_or_assign(std::get<std::string>(token.value),
-                                  true);
+    bindings[innermost[ctxt.getSymbol(tok)] - 1].defined = true;
 }
 
 void NameResolver::StmtResolveVisitor::operator()(const Block* s) const
@@ -99,7 +161,7 @@ void NameResolver::StmtResolveVisitor::operator()(const Block* s) const
 
 void NameResolver::StmtResolveVisitor::operator()(const VarDecl* v) const
 {
-    r.declare(v->name);
+    r.declare(v->name, v->isConst);
     if (v->init)
         r.resolve(*v->init);
     r.define(v->name);
@@ -107,25 +169,33 @@ void NameResolver::StmtResolveVisitor::operator()(const VarDecl* v) const
 
 void NameResolver::StmtResolveVisitor::operator()(const FunDecl* f) const
 {
-    bool wasInFunction = r.isInFunction; // TODO: RAII.
-    r.isInFunction = true;
-
     r.declare(f->name);
     r.define(f->name);
 
-    r.beginScope();
+    if (r.bodies == FunctionBodies::Defer && r.scopeMarks.empty())
+        return;
+
+    r.resolveFunctionBody(f);
+}
+
+void NameResolver::resolveFunctionBody(const FunDecl* f)
+{
+    bool wasInFunction = isInFunction; // TODO: RAII.
+    isInFunction = true;
+
+    beginScope();
 
     for(auto tok : f->params)
     {
-        r.declare(tok);
-        r.define(tok);
+        declare(tok);
+        define(tok);
     }
 
-    r.resolveStatements(f->body);
+    resolveStatements(f->body);
 
-    r.endScope();
+    endScope();
 
-    r.isInFunction = wasInFunction;
+    isInFunction = wasInFunction;
 }
 
 void NameResolver::StmtResolveVisitor::operator()(const PrintStatement* s) const
@@ -168,26 +238,27 @@ void NameResolver::StmtResolveVisitor::operator()(const Unit* s) const
 
 void NameResolver::ExprResolveVisitor::operator()(const DeclRef* ref) const
 {
-    const auto& token = r.ctxt.getToken(ref->name);
-    const auto& name = std::get<std::string>(token.value);
-    
-    if (!r.stack.empty())
-    {
-        auto it = r.stack.back().find(name);
-        if (it != r.stack.back().end() && !it->second)
-            throw CompileTimeError{ref->name, "Can't read local variable in its own initializer."};
-    }
+    const auto* binding = r.innermostBinding(ref->name);
+    if (binding && binding->depth == r.scopeMarks.size() && !binding->defined)
+        throw CompileTimeError{ref->name, "Can't read local variable in its own initializer."};
 
-    r.resolveLocal(r.currentExpr, name);
+    r.resolveLocal(r.currentExpr, ref->name);
 }
 
 void NameResolver::ExprResolveVisitor::operator()(const Assign* a) const
 {
-    const auto& token = r.ctxt.getToken(a->name);
-    const auto& name = std::get<std::string>(token.value);
+    const auto* binding = r.innermostBinding(a->name);
+    bool isConst = binding ? binding->isConst : r.globalConstants.contains(r.ctxt.getSymbol(a->name));
+    if (isConst)
+    {
+        const auto& name = std::get<std::string>(r.ctxt.getToken(a->name).value);
+        throw CompileTimeError{a->name, fmt::format("Can't assign to constant '{}'.", name)};
+    }
 
+    // Resolving the value overwrites the current expression.
+    ExpressionIndex self = r.currentExpr;
     r.resolve(a->value);
-    r.resolveLocal(r.currentExpr, name);
+    r.resolveLocal(self, a->name);
 }
 
 void NameResolver::ExprResolveVisitor::operator()(const Binary* b) const
@@ -215,3 +286,723 @@ void NameResolver::ExprResolveVisitor::operator()(const Call* c) const
         r.resolve(arg);
     }
 }
+
+void TypeFacts::merge(TypeFacts&& other)
+{
+    auto mergeFacts = [](std::vector<StaticType>& into, std::vector<StaticType>& from) {
+        if (into.size() < from.size())
+            into.resize(from.size(), StaticType::None);
+        for (unsigned i = 0; i < from.size(); ++i)
+        {
+            if (from[i] != StaticType::None)
+                into[i] = from[i];
+        }
+    };
+    mergeFacts(binaryOperands, other.binaryOperands);
+    mergeFacts(unaryOperands, other.unaryOperands);
+}
+
+template<typename Analyze>
+TypeFacts TypeInference::run(Analyze analyze)
+{
+    // The first run finds the locals written by nested functions,
+    // the second one computes the facts.
+    collectingEscapes = true;
+    state = TypeState{};
+    analyze();
+
+    collectingEscapes = false;
+    facts = TypeFacts{};
+    state = TypeState{};
+    analyze();
+
+    return std::move(facts);
+}
+
+TypeFacts TypeInference::inferTypes(StatementIndex stmt, FunctionBodies bodies)
+{
+    this->bodies = bodies;
+    return run([&] { infer(stmt); });
+}
+
+TypeFacts TypeInference::inferTypes(const FunDecl& decl)
+{
+    bodies = FunctionBodies::Analyze;
+    return run([&] { stmtVisitor(&decl); });
+}
+
+StaticType TypeInference::infer(ExpressionIndex expr)
+{
+    return std::visit(exprVisitor, expr);
+}
+
+void TypeInference::infer(StatementIndex stmt)
+{
+    // Skip dead code.
+    if (!state)
+        return;
+
+    auto node = ctxt.getNode(stmt);
+    std::visit(stmtVisitor, node);
+}
+
+void TypeInference::inferStatements(const std::vector<StatementIndex>& statements)
+{
+    for (auto stmt : statements)
+        infer(stmt);
+}
+
+void TypeInference::declare(Index<Token> tok, StaticType type)
+{
+    if (scopes.empty())
+        return;
+
+    const auto& name = std::get<std::string>(ctxt.getToken(tok).value);
+    scopes.back().insert_or_assign(name, Variable{tok.id, functionDepth});
+    if (state)
+        state->insert_or_assign(tok.id, type);
+}
+
+std::optional<TypeInference::Variable> TypeInference::lookup(Index<Token> tok) const
+{
+    const auto& name = std::get<std::string>(ctxt.getToken(tok).value);
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it)
+    {
+        if (auto found = it->find(name); found != it->end())
+            return found->second;
+    }
+    return std::nullopt;
+}
+
+bool TypeInference::isTracked(const Variable& var) const
+{
+    return var.functionDepth == functionDepth && !escaping.contains(var.id);
+}
+
+StaticType TypeInference::typeOf(Index<Token> tok) const
+{
+    auto var = lookup(tok);
+    if (!var || !isTracked(*var) || !state)
+        return StaticType::Unknown;
+
+    if (auto it = state->find(var->id); it != state->end())
+        return it->second;
+    return StaticType::Unknown;
+}
+
+void TypeInference::setType(Index<Token> tok, StaticType type)
+{
+    ++assignments;
+    auto var = lookup(tok);
+    if (!var)
+        return;
+
+    if (var->functionDepth != functionDepth)
+    {
+        if (collectingEscapes)
+            escaping.insert(var->id);
+        return;
+    }
+
+    if (isTracked(*var) && state)
+        state->insert_or_assign(var->id, type);
+}
+
+// Operations only succeed with operands of the right type.
+void TypeInference::refine(ExpressionIndex operand, StaticType type)
+{
+    if (!refineOperands)
+        return;
+
+    while (const auto* g = std::get_if<Index<Grouping>>(&operand))
+        operand = std::get<const Grouping*>(ctxt.getNode(*g))->subExpr;
+
+    if (const auto* r = std::get_if<Index<DeclRef>>(&operand))
+    {
+        auto var = lookup(std::get<const DeclRef*>(ctxt.getNode(*r))->name);
+        if (var && isTracked(*var) && state)
+            state->insert_or_assign(var->id, type);
+    }
+}
+
+StaticType TypeInference::join(StaticType lhs, StaticType rhs) noexcept
+{
+    if (lhs == StaticType::None)
+        return rhs;
+    if (rhs == StaticType::None)
+        return lhs;
+    return lhs == rhs ? lhs : StaticType::Unknown;
+}
+
+std::optional<TypeInference::TypeState> TypeInference::join(const std::optional<TypeState>& lhs,
+                                                           const std::optional<TypeState>& rhs)
+{
+    if (!lhs)
+        return rhs;
+    if (!rhs)
+        return lhs;
+
+    TypeState result;
+    for (const auto& [var, type] : *lhs)
+    {
+        if (auto it = rhs->find(var); it != rhs->end())
+            result.insert_or_assign(var, join(type, it->second));
+    }
+    return result;
+}
+
+void TypeInference::record(std::vector<StaticType>& facts, unsigned id, StaticType type)
+{
+    if (facts.size() <= id)
+        facts.resize(id + 1, StaticType::None);
+    facts[id] = join(facts[id], type);
+}
+
+StaticType TypeInference::ExprInferVisitor::operator()(Index<Literal> l) const
+{
+    const auto* node = std::get<const Literal*>(t.ctxt.getNode(l));
+    switch (t.ctxt.getToken(node->value).type)
+    {
+        case TokenType::NUMBER: return StaticType::Number;
+        case TokenType::STRING: return StaticType::String;
+        case TokenType::TRUE:
+        case TokenType::FALSE: return StaticType::Bool;
+        case TokenType::NIL: return StaticType::Nil;
+        default: return StaticType::Unknown;
+    }
+}
+
+StaticType TypeInference::ExprInferVisitor::operator()(Index<Grouping> g) const
+{
+    return t.infer(std::get<const Grouping*>(t.ctxt.getNode(g))->subExpr);
+}
+
+StaticType TypeInference::ExprInferVisitor::operator()(Index<DeclRef> r) const
+{
+    return t.typeOf(std::get<const DeclRef*>(t.ctxt.getNode(r))->name);
+}
+
+StaticType TypeInference::ExprInferVisitor::operator()(Index<Assign> a) const
+{
+    const auto* node = std::get<const Assign*>(t.ctxt.getNode(a));
+    auto type = t.infer(node->value);
+    t.setType(node->name, type);
+    return type;
+}
+
+StaticType TypeInference::ExprInferVisitor::operator()(Index<Call> c) const
+{
+    const auto* node = std::get<const Call*>(t.ctxt.getNode(c));
+    t.infer(node->callee);
+    for (auto arg : node->args)
+        t.infer(arg);
+    return StaticType::Unknown;
+}
+
+StaticType TypeInference::ExprInferVisitor::operator()(Index<Unary> u) const
+{
+    const auto* node = std::get<const Unary*>(t.ctxt.getNode(u));
+    auto operand = t.infer(node->subExpr);
+    record(t.facts.unaryOperands, u.id, operand);
+
+    if (node->kind == UnaryOp::Negate)
+    {
+        t.refine(node->subExpr, StaticType::Number);
+        return StaticType::Number;
+    }
+    return StaticType::Bool;
+}
+
+StaticType TypeInference::ExprInferVisitor::operator()(Index<Binary> b) const
+{
+    const auto* node = std::get<const Binary*>(t.ctxt.getNode(b));
+    auto type = node->kind;
+    auto left = t.infer(node->left);
+
+    // The right operand is not always evaluated.
+    if (type == BinaryOp::And || type == BinaryOp::Or)
+    {
+        auto beforeRight = t.state;
+        auto right = t.infer(node->right);
+        t.state = join(beforeRight, t.state);
+        record(t.facts.binaryOperands, b.id, join(left, right));
+        return join(left, right);
+    }
+
+    auto assignmentsBeforeRight = t.assignments;
+    auto right = t.infer(node->right);
+    record(t.facts.binaryOperands, b.id, join(left, right));
+
+    // The left operand was read before the right one ran. When the
+    // right operand assigns, the variable may no longer hold the value
+    // checked by the operation.
+    bool refineLeft = t.assignments == assignmentsBeforeRight;
+
+    switch (type)
+    {
+        case BinaryOp::Add:
+        {
+            auto result = join(left, right);
+            if (result == StaticType::Unknown)
+            {
+                // Both operands have the same type if the addition succeeds.
+                if (left == StaticType::Number || left == StaticType::String)
+                    result = left;
+                else if (right == StaticType::Number || right == StaticType::String)
+                    result = right;
+            }
+            if (result == StaticType::Number || result == StaticType::String)
+            {
+                if (refineLeft)
+                    t.refine(node->left, result);
+                t.refine(node->right, result);
+                return result;
+            }
+            return StaticType::Unknown;
+        }
+
+        case BinaryOp::Divide:
+        case BinaryOp::Multiply:
+        case BinaryOp::Subtract:
+            if (refineLeft)
+                t.refine(node->left, StaticType::Number);
+            t.refine(node->right, StaticType::Number);
+            return StaticType::Number;
+
+        case BinaryOp::Greater:
+        case BinaryOp::GreaterEqual:
+        case BinaryOp::Less:
+        case BinaryOp::LessEqual:
+            if (refineLeft)
+                t.refine(node->left, StaticType::Number);
+            t.refine(node->right, StaticType::Number);
+            return StaticType::Bool;
+
+        default:
+            return StaticType::Bool;
+    }
+}
+
+void TypeInference::StmtInferVisitor::operator()(const PrintStatement* s) const
+{
+    t.infer(s->subExpr);
+}
+
+void TypeInference::StmtInferVisitor::operator()(const ExprStatement* s) const
+{
+    t.infer(s->subExpr);
+}
+
+void TypeInference::StmtInferVisitor::operator()(const VarDecl* v) const
+{
+    auto type = v->init ? t.infer(*v->init) : StaticType::Nil;
+    t.declare(v->name, type);
+}
+
+void TypeInference::StmtInferVisitor::operator()(const FunDecl* f) const
+{
+    t.declare(f->name, StaticType::Unknown);
+    if (t.bodies == FunctionBodies::Defer && t.scopes.empty())
+        return;
+
+    // The body runs later, with parameters of any type.
+    auto outerState = std::move(t.state);
+    t.state = TypeState{};
+    ++t.functionDepth;
+    t.scopes.emplace_back();
+    for (auto param : f->params)
+        t.declare(param, StaticType::Unknown);
+    t.inferStatements(f->body);
+    t.scopes.pop_back();
+    --t.functionDepth;
+    t.state = std::move(outerState);
+}
+
+void TypeInference::StmtInferVisitor::operator()(const Return* s) const
+{
+    if (s->value)
+        t.infer(*s->value);
+    t.state = std::nullopt;
+}
+
+void TypeInference::StmtInferVisitor::operator()(const Block* s) const
+{
+    t.scopes.emplace_back();
+    t.inferStatements(s->statements);
+    t.scopes.pop_back();
+}
+
+void TypeInference::StmtInferVisitor::operator()(const IfStatement* s) const
+{
+    t.infer(s->condition);
+    auto beforeBranches = t.state;
+    t.infer(s->thenBranch);
+    auto afterThen = std::move(t.state);
+    t.state = std::move(beforeBranches);
+    if (s->elseBranch)
+        t.infer(*s->elseBranch);
+    t.state = join(afterThen, t.state);
+}
+
+void TypeInference::StmtInferVisitor::operator()(const WhileStatement* s) const
+{
+    // Iterate until the state at the loop head is stable. Each
+    // iteration can only make types less precise, so this terminates.
+    while (true)
+    {
+        auto head = t.state;
+        t.infer(s->condition);
+        auto exit = t.state;
+        t.infer(s->body);
+        t.state = join(head, t.state);
+        if (t.state == head)
+        {
+            t.state = std::move(exit);
+            return;
+        }
+    }
+}
+
+void TypeInference::StmtInferVisitor::operator()(const Unit* s) const
+{
+    t.inferStatements(s->statements);
+}
+
+namespace
+{
+class AssignmentCollector
+{
+public:
+    explicit AssignmentCollector(const ASTContext& ctxt) noexcept : ctxt(ctxt) {}
+
+    void collect(StatementIndex stmt)
+    {
+        std::visit(Overloaded{
+            [this](const PrintStatement* s) { collect(s->subExpr); },
+            [this](const ExprStatement* s) { collect(s->subExpr); },
+            [this](const VarDecl* s) { if (s->init) collect(*s->init); },
+            [this](const FunDecl* s) { for (auto child : s->body) collect(child); },
+            [this](const Return* s) { if (s->value) collect(*s->value); },
+            [this](const Block* s) { for (auto child : s->statements) collect(child); },
+            [this](const IfStatement* s) {
+                collect(s->condition);
+                collect(s->thenBranch);
+                if (s->elseBranch)
+                    collect(*s->elseBranch);
+            },
+            [this](const WhileStatement* s) {
+                collect(s->condition);
+                collect(s->body);
+            },
+            [this](const Unit* s) { for (auto child : s->statements) collect(child); }
+        }, ctxt.getNode(stmt));
+    }
+
+    void collect(ExpressionIndex expr)
+    {
+        std::visit(Overloaded{
+            [this](const Binary* e) { collect(e->left); collect(e->right); },
+            [this](const Assign* e) {
+                names.insert(std::get<std::string>(ctxt.getToken(e->name).value));
+                collect(e->value);
+            },
+            [this](const Unary* e) { collect(e->subExpr); },
+            [](const Literal*) {},
+            [this](const Grouping* e) { collect(e->subExpr); },
+            [](const DeclRef*) {},
+            [this](const Call* e) {
+                collect(e->callee);
+                for (auto arg : e->args)
+                    collect(arg);
+            }
+        }, ctxt.getNode(expr));
+    }
+
+    std::unordered_set<std::string> names;
+
+private:
+    const ASTContext& ctxt;
+};
+} // anonymous namespace
+
+std::unordered_set<std::string> collectAssignedNames(const ASTContext& ctxt, StatementIndex stmt)
+{
+    AssignmentCollector collector(ctxt);
+    collector.collect(stmt);
+    return std::move(collector.names);
+}
+
+namespace
+{
+class CaptureFinder
+{
+public:
+    explicit CaptureFinder(const ASTContext& ctxt) noexcept : ctxt(ctxt) {}
+
+    std::unordered_set<Index<Token>> find(StatementIndex stmt)
+    {
+        visit(stmt);
+        return std::move(captured);
+    }
+
+private:
+    struct Local
+    {
+        unsigned symbol;
+        Index<Token> declaration;
+        unsigned function;
+    };
+
+    void declare(Index<Token> name)
+    {
+        if (function == 0 && scopeMarks.empty())
+            return;
+        locals.push_back({ctxt.getSymbol(name), name, function});
+    }
+
+    void reference(Index<Token> name)
+    {
+        unsigned symbol = ctxt.getSymbol(name);
+        for (auto it = locals.rbegin(); it != locals.rend(); ++it)
+        {
+            if (it->symbol != symbol)
+                continue;
+            if (it->function != function)
+                captured.insert(it->declaration);
+            return;
+        }
+    }
+
+    void beginScope() { scopeMarks.push_back(locals.size()); }
+    void endScope()
+    {
+        locals.resize(scopeMarks.back());
+        scopeMarks.pop_back();
+    }
+
+    void visit(ExpressionIndex expr)
+    {
+        std::visit(Overloaded{
+            [this](const Binary* b) { visit(b->left); visit(b->right); },
+            [this](const Assign* a) { visit(a->value); reference(a->name); },
+            [this](const Unary* u) { visit(u->subExpr); },
+            [](const Literal*) {},
+            [this](const Grouping* g) { visit(g->subExpr); },
+            [this](const DeclRef* r) { reference(r->name); },
+            [this](const Call* c)
+            {
+                visit(c->callee);
+                for (auto arg : c->args)
+                    visit(arg);
+            }
+        }, ctxt.getNode(expr));
+    }
+
+    void visit(StatementIndex stmt)
+    {
+        std::visit(Overloaded{
+            [this](const PrintStatement* s) { visit(s->subExpr); },
+            [this](const ExprStatement* s) { visit(s->subExpr); },
+            [this](const VarDecl* v)
+            {
+                if (v->init)
+                    visit(*v->init);
+                declare(v->name);
+            },
+            [this](const FunDecl* f)
+            {
+                declare(f->name);
+                ++function;
+                beginScope();
+                for (auto param : f->params)
+                    declare(param);
+                for (auto s : f->body)
+                    visit(s);
+                endScope();
+                --function;
+            },
+            [this](const Return* s)
+            {
+                if (s->value)
+                    visit(*s->value);
+            },
+            [this](const Block* s)
+            {
+                beginScope();
+                for (auto child : s->statements)
+                    visit(child);
+                endScope();
+            },
+            [this](const IfStatement* s)
+            {
+                visit(s->condition);
+                visit(s->thenBranch);
+                if (s->elseBranch)
+                    visit(*s->elseBranch);
+            },
+            [this](const WhileStatement* s)
+            {
+                visit(s->condition);
+                visit(s->body);
+            },
+            [this](const Unit* s)
+            {
+                for (auto child : s->statements)
+                    visit(child);
+            }
+        }, ctxt.getNode(stmt));
+    }
+
+    const ASTContext& ctxt;
+    std::vector<Local> locals;
+    std::vector<std::size_t> scopeMarks;
+    unsigned function = 0;
+    std::unordered_set<Index<Token>> captured;
+};
+} // anonymous namespace
+
+std::unordered_set<Index<Token>> findCapturedLocals(const ASTContext& ctxt, StatementIndex stmt)
+{
+    return CaptureFinder(ctxt).find(stmt);
+}
+
+std::unordered_set<Index<Token>> PurityAnalysis::findPureFunctions(StatementIndex stmt)
+{
+    assignedNames = collectAssignedNames(ctxt, stmt);
+
+    std::vector<StatementIndex> topLevel{stmt};
+    if (const auto* unit = std::get_if<Index<Unit>>(&stmt))
+        topLevel = std::get<const Unit*>(ctxt.getNode(*unit))->statements;
+
+    std::vector<const FunDecl*> decls;
+    for (auto s : topLevel)
+    {
+        std::visit(Overloaded{
+            [&](const VarDecl* v) { ++globalDeclarations[std::get<std::string>(ctxt.getToken(v->name).value)]; },
+            [&](const FunDecl* f) {
+                ++globalDeclarations[std::get<std::string>(ctxt.getToken(f->name).value)];
+                decls.push_back(f);
+            },
+            [](auto) {}
+        }, ctxt.getNode(s));
+    }
+
+    std::unordered_map<std::string, FunctionInfo> functions;
+    for (const auto* decl : decls)
+    {
+        const auto& name = std::get<std::string>(ctxt.getToken(decl->name).value);
+        FunctionInfo info{decl->name, isImmutableGlobal(name), {}};
+        current = &info;
+        scopes.emplace_back();
+        for (auto param : decl->params)
+            scopes.back().insert(std::get<std::string>(ctxt.getToken(param).value));
+        for (auto child : decl->body)
+            check(child);
+        scopes.pop_back();
+        current = nullptr;
+
+        if (info.pure)
+            functions.insert_or_assign(name, std::move(info));
+    }
+
+    // A function calling an impure one is impure too.
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        std::erase_if(functions, [&](const auto& entry) {
+            bool callsImpure = std::ranges::any_of(entry.second.callees, [&](const std::string& callee) {
+                return !functions.contains(callee);
+            });
+            changed |= callsImpure;
+            return callsImpure;
+        });
+    }
+
+    std::unordered_set<Index<Token>> result;
+    for (const auto& [_, info] : functions)
+        result.insert(info.name);
+    return result;
+}
+
+bool PurityAnalysis::isLocal(const std::string& name) const
+{
+    return std::ranges::any_of(scopes, [&](const auto& scope) { return scope.contains(name); });
+}
+
+bool PurityAnalysis::isImmutableGlobal(const std::string& name) const
+{
+    auto it = globalDeclarations.find(name);
+    return it != globalDeclarations.end() && it->second == 1 && !assignedNames.contains(name);
+}
+
+void PurityAnalysis::check(StatementIndex stmt)
+{
+    std::visit(Overloaded{
+        [this](const PrintStatement*) { current->pure = false; },
+        [this](const ExprStatement* s) { check(s->subExpr); },
+        [this](const VarDecl* s) {
+            if (s->init)
+                check(*s->init);
+            scopes.back().insert(std::get<std::string>(ctxt.getToken(s->name).value));
+        },
+        [this](const FunDecl*) { current->pure = false; },
+        [this](const Return* s) { if (s->value) check(*s->value); },
+        [this](const Block* s) {
+            scopes.emplace_back();
+            for (auto child : s->statements)
+                check(child);
+            scopes.pop_back();
+        },
+        [this](const IfStatement* s) {
+            check(s->condition);
+            check(s->thenBranch);
+            if (s->elseBranch)
+                check(*s->elseBranch);
+        },
+        [this](const WhileStatement* s) {
+            check(s->condition);
+            check(s->body);
+        },
+        [this](const Unit*) { current->pure = false; }
+    }, ctxt.getNode(stmt));
+}
+
+void PurityAnalysis::check(ExpressionIndex expr)
+{
+    std::visit(Overloaded{
+        [this](const Binary* e) { check(e->left); check(e->right); },
+        [this](const Assign* e) {
+            if (!isLocal(std::get<std::string>(ctxt.getToken(e->name).value)))
+                current->pure = false;
+            check(e->value);
+        },
+        [this](const Unary* e) { check(e->subExpr); },
+        [](const Literal*) {},
+        [this](const Grouping* e) { check(e->subExpr); },
+        [this](const DeclRef* e) {
+            const auto& name = std::get<std::string>(ctxt.getToken(e->name).value);
+            if (!isLocal(name) && !isImmutableGlobal(name))
+                current->pure = false;
+        },
+        [this](const Call* e) {
+            // Only direct calls of global functions can be checked.
+            const auto* callee = std::get_if<Index<DeclRef>>(&e->callee);
+            if (!callee)
+            {
+                current->pure = false;
+                return;
+            }
+            const auto& name = std::get<std::string>(
+                ctxt.getToken(std::get<const DeclRef*>(ctxt.getNode(*callee))->name).value);
+            if (isLocal(name))
+                current->pure = false;
+            else
+                current->callees.insert(name);
+            check(e->callee);
+
+            for (auto arg : e->args)
+                check(arg);
+        }
+    }, ctxt.getNode(expr));
+}
@@ -8,6 +8,38 @@ std::string print(Index<Token> t, const ASTContext& c) noexcept
     return print(c.getToken(t));
 }
 
+void ASTContext::addTokens(TokenList&& newTokens) noexcept
+{
+    // The end of file token is replaced by the new tokens.
+    unsigned first = tokens.size() - 1;
+    tokens.mergeTokensFrom(std::move(newTokens));
+    internTokensFrom(first);
+}
+
+Index<Token> ASTContext::makeSyntheticToken(Token token) noexcept
+{
+    tokens.push_back(token);
+    internTokensFrom(tokens.size() - 1);
+    return {tokens.size() - 1};
+}
+
+void ASTContext::internTokensFrom(unsigned first) noexcept
+{
+    tokenSymbols.resize(first);
+    for (unsigned i = first; i < tokens.size(); ++i)
+    {
+        const auto& token = tokens[i];
+        if (token.type != TokenType::IDENTIFIER)
+        {
+            tokenSymbols.push_back(noSymbol);
+            continue;
+        }
+
+        auto [it, _] = symbolIds.try_emplace(std::get<std::string>(token.value), symbolIds.size());
+        tokenSymbols.push_back(it->second);
+    }
+}
+
 template<typename... T>
 std::string parenthesize(T&&... strings) noexcept
 {
@@ -90,7 +122,7 @@ std::string ASTPrinter::StmtPrintVisitor::operator()(const ExprStatement* s) con
 std::string ASTPrinter::StmtPrintVisitor::operator()(const VarDecl* s) const noexcept
 {
     std::string init = s->init ? printer.print(*s->init) : "<NULL>";
-    return parenthesize(std::string_view("var"), ::print(s->name, printer.c), init);
+    return parenthesize(std::string_view(s->isConst ? "const" : "var"), ::print(s->name, printer.c), init);
 }
 
 std::string ASTPrinter::StmtPrintVisitor::operator()(const FunDecl* s) const noexcept
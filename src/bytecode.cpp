@@ -0,0 +1,129 @@
+#include "include/bytecode.h"
+
+#include <algorithm>
+
+#include <fmt/format.h>
+
+Index<Token> Chunk::siteBefore(unsigned offset) const noexcept
+{
+    auto it = std::ranges::lower_bound(sites, offset, {}, [](const auto& site) { return site.first; });
+    return std::prev(it)->second;
+}
+
+bool operator==(Value lhs, Value rhs) noexcept
+{
+    if (lhs.getType() != rhs.getType())
+        return false;
+
+    switch (lhs.getType())
+    {
+        case Value::Type::Undefined:
+        case Value::Type::Nil:
+            return true;
+        case Value::Type::Bool:
+            return lhs.asBool() == rhs.asBool();
+        case Value::Type::Number:
+            return lhs.asNumber() == rhs.asNumber();
+        case Value::Type::Object:
+            break;
+    }
+
+    // Functions are never equal, not even to themselves.
+    if (!lhs.isObject(ObjType::String) || !rhs.isObject(ObjType::String))
+        return false;
+    return static_cast<ObjString*>(lhs.asObject())->view() == static_cast<ObjString*>(rhs.asObject())->view();
+}
+
+std::string print(Value value)
+{
+    switch (value.getType())
+    {
+        case Value::Type::Undefined:
+        case Value::Type::Nil:
+            return "nil";
+        case Value::Type::Bool:
+            return value.asBool() ? "true" : "false";
+        case Value::Type::Number:
+            return fmt::format("{}", value.asNumber());
+        case Value::Type::Object:
+            break;
+    }
+
+    if (value.isObject(ObjType::String))
+        return std::string(static_cast<ObjString*>(value.asObject())->view());
+    return "<Callable>";
+}
+
+Heap::~Heap()
+{
+    while (objects)
+    {
+        Obj* next = objects->next;
+        delete objects;
+        objects = next;
+    }
+}
+
+void Heap::mark(Value value)
+{
+    if (value.isObject())
+        mark(value.asObject());
+}
+
+void Heap::mark(Obj* obj)
+{
+    if (obj->marked)
+        return;
+    obj->marked = true;
+    worklist.push_back(obj);
+}
+
+void Heap::trace(Obj* obj)
+{
+    switch (obj->type)
+    {
+        case ObjType::String:
+        case ObjType::Native:
+            break;
+        case ObjType::Cell:
+            mark(static_cast<ObjCell*>(obj)->value);
+            break;
+        case ObjType::Closure:
+            for (auto* cell : static_cast<ObjClosure*>(obj)->captures)
+                mark(cell);
+            break;
+    }
+}
+
+void Heap::collect()
+{
+    for (const auto& proto : protos)
+        for (auto constant : proto->chunk.constants)
+            mark(constant);
+
+    while (!worklist.empty())
+    {
+        Obj* obj = worklist.back();
+        worklist.pop_back();
+        trace(obj);
+    }
+
+    std::size_t live = 0;
+    Obj** link = &objects;
+    while (*link)
+    {
+        Obj* obj = *link;
+        if (obj->marked)
+        {
+            obj->marked = false;
+            link = &obj->next;
+            ++live;
+            continue;
+        }
+        *link = obj->next;
+        delete obj;
+    }
+
+    allocated = live;
+    nextCollection = std::max<std::size_t>(1024, live * 2);
+}
@@ -0,0 +1,673 @@
+#include "include/closure_compiler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <ostream>
+#include <unordered_map>
+
+#include <fmt/format.h>
+
+using enum TokenType;
+
+namespace
+{
+
+using CompiledExpr = ClosureCompiler::CompiledExpr;
+using Frame = ClosureCompiler::Frame;
+
+// Globals can be defined after the code referring to them is compiled,
+// so they are looked up on the first successful access. Environments
+// never remove their values, the pointer stays valid.
+class GlobalRef
+{
+public:
+    GlobalRef(Environment& globals, Index<Token> name, std::string varName) noexcept
+        : globals(globals), name(name), varName(std::move(varName)) {}
+
+    RuntimeValue& get()
+    {
+        if (!value)
+            value = globals.find(varName);
+        if (!value)
+            throw RuntimeError{name, fmt::format("Undefined variable: '{}'.", varName)};
+        return *value;
+    }
+
+private:
+    Environment& globals;
+    Index<Token> name;
+    std::string varName;
+    RuntimeValue* value = nullptr;
+};
+
+template<typename Op>
+CompiledExpr numberOperator(CompiledExpr left, CompiledExpr right, Index<Token> op, bool checked, Op apply)
+{
+    if (!checked)
+    {
+        return [left = std::move(left), right = std::move(right), apply](Frame& f) -> RuntimeValue {
+            RuntimeValue l = left(f);
+            RuntimeValue r = right(f);
+            return apply(l.get<Number>(), r.get<Number>());
+        };
+    }
+
+    return [left = std::move(left), right = std::move(right), op, apply](Frame& f) -> RuntimeValue {
+        RuntimeValue l = left(f);
+        RuntimeValue r = right(f);
+        if (!l.getIf<Number>() || !r.getIf<Number>())
+            throw RuntimeError{op, "Operand must evaluate to a number."};
+        return apply(l.get<Number>(), r.get<Number>());
+    };
+}
+
+bool isTruthy(const RuntimeValue& val)
+{
+    if (val.is<bool>())
+        return val.get<bool>();
+
+    return !val.is<Nil>();
+}
+
+} // anonymous namespace
+
+ClosureCompiler::ClosureCompiler(const ASTContext& ctxt, const DiagnosticEmitter& diag,
+                                 Environment& globals, const TypeFacts& typeFacts) noexcept
+    : ctxt(ctxt), out(diag.getOutput()), globals(globals), typeFacts(typeFacts)
+{
+}
+
+ClosureCompiler::~ClosureCompiler()
+{
+    for (const auto& weak : cells)
+    {
+        if (auto cell = weak.lock())
+            *cell = Nil{};
+    }
+}
+
+std::function<void(Interpreter&)> ClosureCompiler::compileScript(StatementIndex stmt)
+{
+    captured = findCapturedLocals(ctxt, stmt);
+
+    FunctionState script{nullptr};
+    current = &script;
+    auto body = compile(stmt);
+    current = nullptr;
+
+    return [body = std::move(body), slotCount = script.slotCount, cellCount = script.cellCount](Interpreter& interp) {
+        static const std::vector<Cell> noCaptures;
+        Frame frame{interp, std::vector<RuntimeValue>(slotCount), std::vector<Cell>(cellCount), noCaptures};
+        body(frame);
+    };
+}
+
+ClosureCompiler::CompiledExpr ClosureCompiler::compile(ExpressionIndex expr)
+{
+    return std::visit(exprVisitor, expr);
+}
+
+ClosureCompiler::CompiledStmt ClosureCompiler::compile(StatementIndex stmt)
+{
+    return std::visit(stmtVisitor, ctxt.getNode(stmt));
+}
+
+ClosureCompiler::CompiledStmt ClosureCompiler::compileStatements(const std::vector<StatementIndex>& statements)
+{
+    std::vector<CompiledStmt> compiled;
+    compiled.reserve(statements.size());
+    for (auto stmt : statements)
+        compiled.push_back(compile(stmt));
+
+    if (compiled.size() == 1)
+        return std::move(compiled.front());
+
+    return [compiled = std::move(compiled)](Frame& f) {
+        for (const auto& stmt : compiled)
+            if (stmt(f))
+                return true;
+        return false;
+    };
+}
+
+ClosureCompiler::CompiledExpr ClosureCompiler::compileFunction(const FunDecl* f)
+{
+    auto function = std::make_shared<Function>();
+    function->arity = f->params.size();
+
+    // Arguments are passed in the first slots, captured parameters
+    // are moved to cells on entry.
+    FunctionState state{current};
+    state.scopeDepth = 1;
+    state.slotCount = f->params.size();
+    for (unsigned i = 0; i < f->params.size(); ++i)
+    {
+        bool boxed = captured.contains(f->params[i]);
+        unsigned index = boxed ? state.cellCount++ : i;
+        state.locals.push_back({ctxt.getSymbol(f->params[i]), 1, boxed, index});
+        if (boxed)
+            function->boxedParams.emplace_back(i, index);
+    }
+
+    current = &state;
+    function->body = compileStatements(f->body);
+    current = state.enclosing;
+
+    function->slotCount = state.slotCount;
+    function->cellCount = state.cellCount;
+    function->captures = std::move(state.captures);
+
+    // The captured cells are kept in the function object, where the
+    // collector of the cells can find them.
+    return [function, closureEnv = &globals, &c = *this](Frame& f) -> RuntimeValue {
+        auto fn = std::make_shared<FunctionObject>(FunctionObject{function->arity, closureEnv});
+        fn->cells.reserve(function->captures.size());
+        for (auto capture : function->captures)
+            fn->cells.push_back(capture.fromCell ? f.cells[capture.index] : f.captures[capture.index]);
+
+        fn->compiled = [function, &c, &captures = fn->cells](Interpreter& interp, std::span<RuntimeValue> args) -> RuntimeValue
+        {
+            Frame frame{interp, std::vector<RuntimeValue>(function->slotCount),
+                        std::vector<Cell>(function->cellCount), captures};
+            std::move(args.begin(), args.end(), frame.slots.begin());
+            for (auto [slot, cell] : function->boxedParams)
+                frame.cells[cell] = c.makeCell(std::move(frame.slots[slot]));
+
+            if (function->body(frame))
+                return std::move(frame.result);
+            return Nil{};
+        };
+        return Callable{std::move(fn)};
+    };
+}
+
+ClosureCompiler::Cell ClosureCompiler::makeCell(RuntimeValue value)
+{
+    if (cells.size() >= collectThreshold)
+    {
+        collectCells();
+        collectThreshold = std::max(minCollectThreshold, 2 * cells.size());
+    }
+
+    auto cell = std::make_shared<RuntimeValue>(std::move(value));
+    cells.push_back(cell);
+    return cell;
+}
+
+void ClosureCompiler::collectCells()
+{
+    // The cells, the boxes of the functions stored in them and the
+    // functions refer to each other. References from anywhere else,
+    // like the frames, the globals or the temporaries of a running
+    // expression, are counted by subtracting the ones within the graph
+    // from the reference counts. Everything reached from those is live,
+    // the rest are cycles only referring to themselves.
+    std::vector<Cell> live;
+    live.reserve(cells.size());
+    for (const auto& weak : cells)
+    {
+        if (auto cell = weak.lock())
+            live.push_back(std::move(cell));
+    }
+    cells.assign(live.begin(), live.end());
+
+    std::unordered_map<const RuntimeValue*, unsigned> indexOf;
+    indexOf.reserve(live.size());
+    for (unsigned i = 0; i < live.size(); ++i)
+        indexOf.emplace(live[i].get(), i);
+
+    std::vector<unsigned> cellRefs(live.size());
+    std::unordered_map<const Callable*, unsigned> boxRefs;
+    std::unordered_map<const FunctionObject*, unsigned> fnRefs;
+    for (const auto& cell : live)
+    {
+        const auto* callable = cell->getIf<Callable>();
+        if (!callable || callable->fn->cells.empty())
+            continue;
+        if (boxRefs[callable]++ > 0 || fnRefs[callable->fn.get()]++ > 0)
+            continue;
+        for (const auto& captured : callable->fn->cells)
+            ++cellRefs[indexOf.at(captured.get())];
+    }
+
+    std::vector<bool> reached(live.size());
+    std::vector<unsigned> exploring;
+    auto reach = [&](const FunctionObject& fn) {
+        for (const auto& captured : fn.cells)
+        {
+            unsigned i = indexOf.at(captured.get());
+            if (!reached[i])
+            {
+                reached[i] = true;
+                exploring.push_back(i);
+            }
+        }
+    };
+    for (unsigned i = 0; i < live.size(); ++i)
+    {
+        // Not counting the reference in live.
+        if (static_cast<unsigned>(live[i].use_count()) - 1 > cellRefs[i] && !reached[i])
+        {
+            reached[i] = true;
+            exploring.push_back(i);
+        }
+
+        const auto* callable = live[i]->getIf<Callable>();
+        if (callable && !callable->fn->cells.empty() &&
+            (live[i]->useCount() > boxRefs[callable] || callable->fn.use_count() > fnRefs[callable->fn.get()]))
+            reach(*callable->fn);
+    }
+    while (!exploring.empty())
+    {
+        unsigned i = exploring.back();
+        exploring.pop_back();
+        if (const auto* callable = live[i]->getIf<Callable>())
+            reach(*callable->fn);
+    }
+
+    for (unsigned i = 0; i < live.size(); ++i)
+    {
+        if (!reached[i])
+            *live[i] = Nil{};
+    }
+}
+
+const ClosureCompiler::Local& ClosureCompiler::declareLocal(Index<Token> name)
+{
+    bool boxed = captured.contains(name);
+    unsigned index = boxed ? current->cellCount++ : current->slotCount++;
+    return current->locals.emplace_back(ctxt.getSymbol(name), current->scopeDepth, boxed, index);
+}
+
+void ClosureCompiler::endScope()
+{
+    auto& locals = current->locals;
+    while (!locals.empty() && locals.back().depth == current->scopeDepth)
+        locals.pop_back();
+    --current->scopeDepth;
+}
+
+bool ClosureCompiler::isGlobalScope() const noexcept
+{
+    return !current->enclosing && current->scopeDepth == 0;
+}
+
+int ClosureCompiler::findLocal(const FunctionState& state, unsigned symbol) noexcept
+{
+    for (int i = state.locals.size() - 1; i >= 0; --i)
+        if (state.locals[i].symbol == symbol)
+            return i;
+    return -1;
+}
+
+int ClosureCompiler::findCapture(FunctionState& state, unsigned symbol)
+{
+    if (!state.enclosing)
+        return -1;
+
+    Capture capture;
+    if (int local = findLocal(*state.enclosing, symbol); local >= 0)
+    {
+        assert(state.enclosing->locals[local].captured);
+        capture = {true, state.enclosing->locals[local].index};
+    }
+    else if (int index = findCapture(*state.enclosing, symbol); index >= 0)
+        capture = {false, static_cast<unsigned>(index)};
+    else
+        return -1;
+
+    auto& captures = state.captures;
+    auto it = std::ranges::find_if(captures, [capture](const Capture& c) {
+        return c.fromCell == capture.fromCell && c.index == capture.index;
+    });
+    if (it != captures.end())
+        return it - captures.begin();
+    captures.push_back(capture);
+    return captures.size() - 1;
+}
+
+ClosureCompiler::Variable ClosureCompiler::lookup(Index<Token> name)
+{
+    unsigned symbol = ctxt.getSymbol(name);
+    if (int local = findLocal(*current, symbol); local >= 0)
+    {
+        const auto& found = current->locals[local];
+        return {found.captured ? Access::Cell : Access::Slot, found.index};
+    }
+    if (int index = findCapture(*current, symbol); index >= 0)
+        return {Access::Capture, static_cast<unsigned>(index)};
+    return {Access::Global, 0};
+}
+
+ClosureCompiler::CompiledExpr ClosureCompiler::ExprCompileVisitor::operator()(Index<Binary> idx) const
+{
+    const auto* b = std::get<const Binary*>(c.ctxt.getNode(idx));
+    auto type = b->kind;
+    auto left = c.compile(b->left);
+    auto right = c.compile(b->right);
+    auto op = b->op;
+
+    // Short circuit for logical operators.
+    if (type == BinaryOp::Or)
+    {
+        return [left = std::move(left), right = std::move(right)](Frame& f) {
+            RuntimeValue l = left(f);
+            if (isTruthy(l))
+                return l;
+            return right(f);
+        };
+    }
+    if (type == BinaryOp::And)
+    {
+        return [left = std::move(left), right = std::move(right)](Frame& f) {
+            RuntimeValue l = left(f);
+            if (!isTruthy(l))
+                return l;
+            return right(f);
+        };
+    }
+
+    // Operands of statically known types need no checks.
+    auto operands = c.typeFacts.operandsOf(idx);
+    bool checked = operands != StaticType::Number;
+    switch (type)
+    {
+        case BinaryOp::Divide: return numberOperator(std::move(left), std::move(right), op, checked, std::divides<>{});
+        case BinaryOp::Multiply: return numberOperator(std::move(left), std::move(right), op, checked, std::multiplies<>{});
+        case BinaryOp::Subtract: return numberOperator(std::move(left), std::move(right), op, checked, std::minus<>{});
+        case BinaryOp::Greater: return numberOperator(std::move(left), std::move(right), op, checked, std::greater<>{});
+        case BinaryOp::GreaterEqual: return numberOperator(std::move(left), std::move(right), op, checked, std::greater_equal<>{});
+        case BinaryOp::Less: return numberOperator(std::move(left), std::move(right), op, checked, std::less<>{});
+        case BinaryOp::LessEqual: return numberOperator(std::move(left), std::move(right), op, checked, std::less_equal<>{});
+        case BinaryOp::Equal:
+            return [left = std::move(left), right = std::move(right)](Frame& f) -> RuntimeValue {
+                RuntimeValue l = left(f);
+                return l == right(f);
+            };
+        case BinaryOp::Add:
+            break;
+        default:
+            return [left = std::move(left), right = std::move(right), op](Frame& f) -> RuntimeValue {
+                left(f);
+                right(f);
+                throw RuntimeError{op, "Unexpected binary operator."};
+            };
+    }
+
+    if (operands == StaticType::Number)
+        return numberOperator(std::move(left), std::move(right), op, false, std::plus<>{});
+    if (operands == StaticType::String)
+    {
+        return [left = std::move(left), right = std::move(right)](Frame& f) -> RuntimeValue {
+            RuntimeValue l = left(f);
+            RuntimeValue r = right(f);
+            return *l.getIf<String>() + *r.getIf<String>();
+        };
+    }
+
+    return [left = std::move(left), right = std::move(right), op](Frame& f) -> RuntimeValue {
+        RuntimeValue l = left(f);
+        RuntimeValue r = right(f);
+        if (l.index() != r.index())
+            throw RuntimeError{op, "Operands' type mismatch."};
+
+        if (const auto* number = l.getIf<Number>())
+            return *number + r.get<Number>();
+        if (const auto* str = l.getIf<String>())
+            return *str + r.get<String>();
+
+        throw RuntimeError{op, "Operands with unsupported type."};
+    };
+}
+
+ClosureCompiler::CompiledExpr ClosureCompiler::ExprCompileVisitor::operator()(Index<Assign> idx) const
+{
+    const auto* a = std::get<const Assign*>(c.ctxt.getNode(idx));
+    auto value = c.compile(a->value);
+
+    auto var = c.lookup(a->name);
+    switch (var.access)
+    {
+        case Access::Slot:
+            return [value = std::move(value), i = var.index](Frame& f) {
+                return f.slots[i] = value(f);
+            };
+        case Access::Cell:
+            return [value = std::move(value), i = var.index](Frame& f) {
+                return *f.cells[i] = value(f);
+            };
+        case Access::Capture:
+            return [value = std::move(value), i = var.index](Frame& f) {
+                return *f.captures[i] = value(f);
+            };
+        case Access::Global:
+            break;
+    }
+
+    GlobalRef global(c.globals, a->name, std::get<std::string>(c.ctxt.getToken(a->name).value));
+    return [value = std::move(value), global](Frame& f) mutable {
+        RuntimeValue result = value(f);
+        return global.get() = std::move(result);
+    };
+}
+
+ClosureCompiler::CompiledExpr ClosureCompiler::ExprCompileVisitor::operator()(Index<Unary> idx) const
+{
+    const auto* u = std::get<const Unary*>(c.ctxt.getNode(idx));
+    auto sub = c.compile(u->subExpr);
+
+    if (u->kind == UnaryOp::Not)
+    {
+        return [sub = std::move(sub)](Frame& f) -> RuntimeValue {
+            return !isTruthy(sub(f));
+        };
+    }
+
+    if (c.typeFacts.operandsOf(idx) == StaticType::Number)
+    {
+        return [sub = std::move(sub)](Frame& f) -> RuntimeValue {
+            RuntimeValue value = sub(f);
+            return -value.get<Number>();
+        };
+    }
+
+    return [sub = std::move(sub), op = u->op](Frame& f) -> RuntimeValue {
+        RuntimeValue value = sub(f);
+        if (const auto* number = value.getIf<Number>())
+            return -*number;
+        throw RuntimeError{op, "Operand must evaluate to a number."};
+    };
+}
+
+ClosureCompiler::CompiledExpr ClosureCompiler::ExprCompileVisitor::operator()(Index<Literal> idx) const
+{
+    const auto* l = std::get<const Literal*>(c.ctxt.getNode(idx));
+    RuntimeValue value = literalValue(c.ctxt.getToken(l->value));
+    return [value = std::move(value)](Frame&) { return value; };
+}
+
+ClosureCompiler::CompiledExpr ClosureCompiler::ExprCompileVisitor::operator()(Index<Grouping> idx) const
+{
+    return c.compile(std::get<const Grouping*>(c.ctxt.getNode(idx))->subExpr);
+}
+
+ClosureCompiler::CompiledExpr ClosureCompiler::ExprCompileVisitor::operator()(Index<DeclRef> idx) const
+{
+    const auto* r = std::get<const DeclRef*>(c.ctxt.getNode(idx));
+    auto var = c.lookup(r->name);
+    switch (var.access)
+    {
+        case Access::Slot:
+            return [i = var.index](Frame& f) { return f.slots[i]; };
+        case Access::Cell:
+            return [i = var.index](Frame& f) { return *f.cells[i]; };
+        case Access::Capture:
+            return [i = var.index](Frame& f) { return *f.captures[i]; };
+        case Access::Global:
+            break;
+    }
+
+    GlobalRef global(c.globals, r->name, std::get<std::string>(c.ctxt.getToken(r->name).value));
+    return [global](Frame&) mutable { return global.get(); };
+}
+
+ClosureCompiler::CompiledExpr ClosureCompiler::ExprCompileVisitor::operator()(Index<Call> idx) const
+{
+    const auto* call = std::get<const Call*>(c.ctxt.getNode(idx));
+    auto callee = c.compile(call->callee);
+    std::vector<CompiledExpr> args;
+    args.reserve(call->args.size());
+    for (auto arg : call->args)
+        args.push_back(c.compile(arg));
+
+    return [callee = std::move(callee), args = std::move(args), open = call->open](Frame& f) -> RuntimeValue {
+        RuntimeValue value = callee(f);
+        const auto* callable = value.getIf<Callable>();
+        if (!callable)
+            throw RuntimeError{open, "Can only call functions and classes."};
+        if (callable->fn->arity != args.size())
+            throw RuntimeError{open, fmt::format("Expected {} arguments but got {}.", callable->fn->arity, args.size())};
+
+        std::vector<RuntimeValue> argValues;
+        argValues.reserve(args.size());
+        for (const auto& arg : args)
+            argValues.push_back(arg(f));
+        return f.interp.call(*callable->fn, argValues, open);
+    };
+}
+
+ClosureCompiler::CompiledStmt ClosureCompiler::StmtCompileVisitor::operator()(const PrintStatement* s) const
+{
+    return [sub = c.compile(s->subExpr), &out = c.out](Frame& f) {
+        out << print(sub(f)) << '\n';
+        return false;
+    };
+}
+
+ClosureCompiler::CompiledStmt ClosureCompiler::StmtCompileVisitor::operator()(const ExprStatement* s) const
+{
+    return [sub = c.compile(s->subExpr)](Frame& f) {
+        sub(f);
+        return false;
+    };
+}
+
+ClosureCompiler::CompiledStmt ClosureCompiler::StmtCompileVisitor::operator()(const VarDecl* v) const
+{
+    CompiledExpr init = [](Frame&) -> RuntimeValue { return Nil{}; };
+    if (v->init)
+        init = c.compile(*v->init);
+
+    if (c.isGlobalScope())
+    {
+        return [init = std::move(init), &globals = c.globals,
+                name = std::get<std::string>(c.ctxt.getToken(v->name).value)](Frame& f) {
+            globals.define(name, init(f));
+            return false;
+        };
+    }
+
+    const auto& local = c.declareLocal(v->name);
+    if (local.captured)
+    {
+        return [init = std::move(init), i = local.index, &c = c](Frame& f) {
+            f.cells[i] = c.makeCell(init(f));
+            return false;
+        };
+    }
+
+    return [init = std::move(init), i = local.index](Frame& f) {
+        f.slots[i] = init(f);
+        return false;
+    };
+}
+
+ClosureCompiler::CompiledStmt ClosureCompiler::StmtCompileVisitor::operator()(const FunDecl* fun) const
+{
+    if (c.isGlobalScope())
+    {
+        return [create = c.compileFunction(fun), &globals = c.globals,
+                name = std::get<std::string>(c.ctxt.getToken(fun->name).value)](Frame& f) {
+            globals.define(name, create(f));
+            return false;
+        };
+    }
+
+    // The function can refer to itself, declare it before the body.
+    const auto& local = c.declareLocal(fun->name);
+    bool boxed = local.captured;
+    unsigned i = local.index;
+    auto create = c.compileFunction(fun);
+    if (boxed)
+    {
+        return [create = std::move(create), i, &c = c](Frame& f) {
+            f.cells[i] = c.makeCell(Nil{});
+            *f.cells[i] = create(f);
+            return false;
+        };
+    }
+
+    return [create = std::move(create), i](Frame& f) {
+        f.slots[i] = create(f);
+        return false;
+    };
+}
+
+ClosureCompiler::CompiledStmt ClosureCompiler::StmtCompileVisitor::operator()(const Return* s) const
+{
+    if (!s->value)
+    {
+        return [](Frame& f) {
+            f.result = Nil{};
+            return true;
+        };
+    }
+
+    return [value = c.compile(*s->value)](Frame& f) {
+        f.result = value(f);
+        return true;
+    };
+}
+
+ClosureCompiler::CompiledStmt ClosureCompiler::StmtCompileVisitor::operator()(const Block* s) const
+{
+    ++c.current->scopeDepth;
+    auto body = c.compileStatements(s->statements);
+    c.endScope();
+    return body;
+}
+
+ClosureCompiler::CompiledStmt ClosureCompiler::StmtCompileVisitor::operator()(const IfStatement* s) const
+{
+    auto condition = c.compile(s->condition);
+    auto thenBranch = c.compile(s->thenBranch);
+    if (!s->elseBranch)
+    {
+        return [condition = std::move(condition), thenBranch = std::move(thenBranch)](Frame& f) {
+            return isTruthy(condition(f)) && thenBranch(f);
+        };
+    }
+
+    return [condition = std::move(condition), thenBranch = std::move(thenBranch),
+            elseBranch = c.compile(*s->elseBranch)](Frame& f) {
+        if (isTruthy(condition(f)))
+            return thenBranch(f);
+        return elseBranch(f);
+    };
+}
+
+ClosureCompiler::CompiledStmt ClosureCompiler::StmtCompileVisitor::operator()(const WhileStatement* s) const
+{
+    return [condition = c.compile(s->condition), body = c.compile(s->body)](Frame& f) {
+        while (isTruthy(condition(f)))
+            if (body(f))
+                return true;
+        return false;
+    };
+}
+
+ClosureCompiler::CompiledStmt ClosureCompiler::StmtCompileVisitor::operator()(const Unit* s) const
+{
+    return c.compileStatements(s->statements);
+}
@@ -0,0 +1,453 @@
+#include "include/compiler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+#include <include/analysis.h>
+
+using enum TokenType;
+
+namespace
+{
+
+constexpr unsigned noSymbol = std::numeric_limits<unsigned>::max();
+
+} // anonymous namespace
+
+const FunctionProto* Compiler::compileScript(StatementIndex stmt)
+{
+    captured = findCapturedLocals(ctxt, stmt);
+
+    // The callee occupies the first slot of every frame.
+    FunctionState script{heap.makeProto(), nullptr};
+    script.locals.push_back({noSymbol, 0, false});
+    script.stackDepth = script.proto->maxStack = 1;
+    current = &script;
+
+    compile(stmt);
+    emit(OpCode::NIL, 1);
+    emit(OpCode::RET, -1);
+
+    current = nullptr;
+    return script.proto;
+}
+
+void Compiler::compile(ExpressionIndex expr)
+{
+    std::visit(exprVisitor, ctxt.getNode(expr));
+}
+
+void Compiler::compile(StatementIndex stmt)
+{
+    std::visit(stmtVisitor, ctxt.getNode(stmt));
+}
+
+void Compiler::compileFunction(const FunDecl* f)
+{
+    FunctionState state{heap.makeProto(), current};
+    state.proto->arity = f->params.size();
+    state.locals.push_back({noSymbol, 0, false});
+    state.scopeDepth = 1;
+    state.stackDepth = state.proto->maxStack = 1 + f->params.size();
+    current = &state;
+
+    for (auto param : f->params)
+    {
+        declareLocal(param);
+        if (state.locals.back().captured)
+        {
+            emit(OpCode::MAKE_CELL, 0);
+            emitShort(state.locals.size() - 1);
+        }
+    }
+
+    for (auto s : f->body)
+        compile(s);
+    emit(OpCode::NIL, 1);
+    emit(OpCode::RET, -1);
+
+    current = state.enclosing;
+    auto index = checkedShort(chunk().functions.size(), "Too many functions in one chunk.");
+    chunk().functions.push_back(state.proto);
+    emit(OpCode::CLOSURE, 1);
+    emitShort(index);
+}
+
+void Compiler::beginScope()
+{
+    ++current->scopeDepth;
+}
+
+void Compiler::endScope()
+{
+    unsigned count = 0;
+    auto& locals = current->locals;
+    while (locals.back().depth == current->scopeDepth)
+    {
+        locals.pop_back();
+        ++count;
+    }
+    --current->scopeDepth;
+
+    if (count == 1)
+        emit(OpCode::POP, -1);
+    else if (count > 1)
+    {
+        emit(OpCode::POPN, -static_cast<int>(count));
+        emitShort(count);
+    }
+}
+
+void Compiler::declareLocal(Index<Token> name)
+{
+    errorSite = name;
+    checkedShort(current->locals.size(), "Too many local variables in function.");
+    current->locals.push_back({ctxt.getSymbol(name), current->scopeDepth, captured.contains(name)});
+}
+
+bool Compiler::isGlobalScope() const noexcept
+{
+    return !current->enclosing && current->scopeDepth == 0;
+}
+
+int Compiler::findLocal(const FunctionState& state, unsigned symbol) noexcept
+{
+    for (int slot = state.locals.size() - 1; slot > 0; --slot)
+        if (state.locals[slot].symbol == symbol)
+            return slot;
+    return -1;
+}
+
+int Compiler::findCapture(FunctionState& state, unsigned symbol)
+{
+    if (!state.enclosing)
+        return -1;
+
+    FunctionProto::Capture capture;
+    if (int slot = findLocal(*state.enclosing, symbol); slot >= 0)
+    {
+        assert(state.enclosing->locals[slot].captured);
+        capture = {true, static_cast<std::uint16_t>(slot)};
+    }
+    else if (int index = findCapture(*state.enclosing, symbol); index >= 0)
+        capture = {false, static_cast<std::uint16_t>(index)};
+    else
+        return -1;
+
+    auto& captures = state.proto->captures;
+    auto it = std::ranges::find_if(captures, [capture](const auto& c) {
+        return c.fromLocal == capture.fromLocal && c.index == capture.index;
+    });
+    if (it != captures.end())
+        return it - captures.begin();
+    captures.push_back(capture);
+    return captures.size() - 1;
+}
+
+Compiler::Variable Compiler::lookup(Index<Token> name)
+{
+    errorSite = name;
+    unsigned symbol = ctxt.getSymbol(name);
+    if (int slot = findLocal(*current, symbol); slot >= 0)
+    {
+        auto access = current->locals[slot].captured ? Access::Cell : Access::Local;
+        return {access, static_cast<std::uint16_t>(slot)};
+    }
+    if (int index = findCapture(*current, symbol); index >= 0)
+        return {Access::Capture, checkedShort(index, "Too many captured variables in function.")};
+    return {Access::Global, checkedShort(symbol, "Too many global variables.")};
+}
+
+void Compiler::emit(OpCode op, int stackEffect)
+{
+    chunk().code.push_back(static_cast<std::uint8_t>(op));
+    current->stackDepth += stackEffect;
+    current->proto->maxStack = std::max(current->proto->maxStack, current->stackDepth);
+}
+
+void Compiler::emitByte(std::uint8_t byte)
+{
+    chunk().code.push_back(byte);
+}
+
+void Compiler::emitShort(unsigned value)
+{
+    chunk().code.push_back(value & 0xff);
+    chunk().code.push_back((value >> 8) & 0xff);
+}
+
+void Compiler::emitSite(Index<Token> site)
+{
+    errorSite = site;
+    chunk().sites.emplace_back(chunk().code.size(), site);
+}
+
+unsigned Compiler::emitJump(OpCode op, int stackEffect)
+{
+    emit(op, stackEffect);
+    emitShort(0);
+    return chunk().code.size() - 2;
+}
+
+void Compiler::patchJump(unsigned jump)
+{
+    auto offset = checkedShort(chunk().code.size() - jump - 2, "Too much code to jump over.");
+    chunk().code[jump] = offset & 0xff;
+    chunk().code[jump + 1] = (offset >> 8) & 0xff;
+}
+
+void Compiler::emitLoop(unsigned start)
+{
+    emit(OpCode::LOOP, 0);
+    emitShort(checkedShort(chunk().code.size() + 2 - start, "Loop body too large."));
+}
+
+void Compiler::emitConstant(Value value)
+{
+    auto index = checkedShort(chunk().constants.size(), "Too many constants in one chunk.");
+    chunk().constants.push_back(value);
+    emit(OpCode::CONSTANT, 1);
+    emitShort(index);
+}
+
+std::uint16_t Compiler::checkedShort(std::size_t value, const char* what) const
+{
+    if (value > std::numeric_limits<std::uint16_t>::max())
+        throw CompileTimeError{errorSite, what};
+    return static_cast<std::uint16_t>(value);
+}
+
+void Compiler::ExprCompileVisitor::operator()(const Binary* b) const
+{
+    auto type = b->kind;
+    c.compile(b->left);
+
+    // Short circuit for logical operators.
+    if (type == BinaryOp::And || type == BinaryOp::Or)
+    {
+        auto end = c.emitJump(type == BinaryOp::And ? OpCode::JUMP_IF_FALSE : OpCode::JUMP_IF_TRUE, 0);
+        c.emit(OpCode::POP, -1);
+        c.compile(b->right);
+        c.patchJump(end);
+        return;
+    }
+
+    c.compile(b->right);
+
+    OpCode op;
+    switch (type)
+    {
+        case BinaryOp::Add: op = OpCode::ADD; break;
+        case BinaryOp::Subtract: op = OpCode::SUBTRACT; break;
+        case BinaryOp::Multiply: op = OpCode::MULTIPLY; break;
+        case BinaryOp::Divide: op = OpCode::DIVIDE; break;
+        case BinaryOp::Greater: op = OpCode::GREATER; break;
+        case BinaryOp::GreaterEqual: op = OpCode::GREATER_EQUAL; break;
+        case BinaryOp::Less: op = OpCode::LESS; break;
+        case BinaryOp::LessEqual: op = OpCode::LESS_EQUAL; break;
+        case BinaryOp::Equal: op = OpCode::EQUAL; break;
+        default: op = OpCode::UNSUPPORTED; break;
+    }
+    c.emitSite(b->op);
+    c.emit(op, -1);
+}
+
+void Compiler::ExprCompileVisitor::operator()(const Assign* a) const
+{
+    c.compile(a->value);
+
+    auto var = c.lookup(a->name);
+    switch (var.access)
+    {
+        case Access::Local: c.emit(OpCode::SET_LOCAL, 0); break;
+        case Access::Cell: c.emit(OpCode::SET_CELL, 0); break;
+        case Access::Capture: c.emit(OpCode::SET_CAPTURE, 0); break;
+        case Access::Global:
+            c.emitSite(a->name);
+            c.emit(OpCode::SET_GLOBAL, 0);
+            break;
+    }
+    c.emitShort(var.index);
+}
+
+void Compiler::ExprCompileVisitor::operator()(const Unary* u) const
+{
+    c.compile(u->subExpr);
+
+    if (u->kind == UnaryOp::Not)
+    {
+        c.emit(OpCode::NOT, 0);
+        return;
+    }
+    c.emitSite(u->op);
+    c.emit(OpCode::NEGATE, 0);
+}
+
+void Compiler::ExprCompileVisitor::operator()(const Literal* l) const
+{
+    const auto& token = c.ctxt.getToken(l->value);
+    switch (token.type)
+    {
+        case TRUE: c.emit(OpCode::TRUE, 1); return;
+        case FALSE: c.emit(OpCode::FALSE, 1); return;
+        case NIL: c.emit(OpCode::NIL, 1); return;
+        default: break;
+    }
+
+    c.errorSite = l->value;
+    if (const auto* number = std::get_if<double>(&token.value))
+        c.emitConstant(Value::fromNumber(*number));
+    else
+        c.emitConstant(Value::fromObject(c.heap.make<ObjString>(std::get<std::string>(token.value))));
+}
+
+void Compiler::ExprCompileVisitor::operator()(const Grouping* g) const
+{
+    c.compile(g->subExpr);
+}
+
+void Compiler::ExprCompileVisitor::operator()(const DeclRef* r) const
+{
+    auto var = c.lookup(r->name);
+    switch (var.access)
+    {
+        case Access::Local: c.emit(OpCode::GET_LOCAL, 1); break;
+        case Access::Cell: c.emit(OpCode::GET_CELL, 1); break;
+        case Access::Capture: c.emit(OpCode::GET_CAPTURE, 1); break;
+        case Access::Global:
+            c.emitSite(r->name);
+            c.emit(OpCode::GET_GLOBAL, 1);
+            break;
+    }
+    c.emitShort(var.index);
+}
+
+void Compiler::ExprCompileVisitor::operator()(const Call* call) const
+{
+    // The callee is checked before the arguments are evaluated.
+    c.compile(call->callee);
+    c.emitSite(call->open);
+    c.emit(OpCode::CHECK_CALL, 0);
+    c.emitByte(call->args.size());
+
+    for (auto arg : call->args)
+        c.compile(arg);
+
+    c.emitSite(call->open);
+    c.emit(OpCode::CALL, -static_cast<int>(call->args.size()));
+    c.emitByte(call->args.size());
+}
+
+void Compiler::StmtCompileVisitor::operator()(const PrintStatement* s) const
+{
+    c.compile(s->subExpr);
+    c.emit(OpCode::PRINT, -1);
+}
+
+void Compiler::StmtCompileVisitor::operator()(const ExprStatement* s) const
+{
+    c.compile(s->subExpr);
+    c.emit(OpCode::POP, -1);
+}
+
+void Compiler::StmtCompileVisitor::operator()(const VarDecl* v) const
+{
+    if (v->init)
+        c.compile(*v->init);
+    else
+        c.emit(OpCode::NIL, 1);
+
+    if (c.isGlobalScope())
+    {
+        c.emit(OpCode::DEFINE_GLOBAL, -1);
+        c.emitShort(c.lookup(v->name).index);
+        return;
+    }
+
+    // The value of the initializer is in the slot of the new local.
+    c.declareLocal(v->name);
+    if (c.current->locals.back().captured)
+    {
+        c.emit(OpCode::MAKE_CELL, 0);
+        c.emitShort(c.current->locals.size() - 1);
+    }
+}
+
+void Compiler::StmtCompileVisitor::operator()(const FunDecl* f) const
+{
+    if (c.isGlobalScope())
+    {
+        c.compileFunction(f);
+        c.emit(OpCode::DEFINE_GLOBAL, -1);
+        c.emitShort(c.lookup(f->name).index);
+        return;
+    }
+
+    // The function can refer to itself, declare it before the body.
+    c.declareLocal(f->name);
+    unsigned slot = c.current->locals.size() - 1;
+    if (!c.current->locals.back().captured)
+    {
+        c.compileFunction(f);
+        return;
+    }
+
+    c.emit(OpCode::NIL, 1);
+    c.emit(OpCode::MAKE_CELL, 0);
+    c.emitShort(slot);
+    c.compileFunction(f);
+    c.emit(OpCode::SET_CELL, 0);
+    c.emitShort(slot);
+    c.emit(OpCode::POP, -1);
+}
+
+void Compiler::StmtCompileVisitor::operator()(const Return* s) const
+{
+    if (s->value)
+        c.compile(*s->value);
+    else
+        c.emit(OpCode::NIL, 1);
+    c.emit(OpCode::RET, -1);
+}
+
+void Compiler::StmtCompileVisitor::operator()(const Block* s) const
+{
+    c.beginScope();
+    for (auto child : s->statements)
+        c.compile(child);
+    c.endScope();
+}
+
+void Compiler::StmtCompileVisitor::operator()(const IfStatement* s) const
+{
+    c.compile(s->condition);
+    auto elseJump = c.emitJump(OpCode::POP_JUMP_IF_FALSE, -1);
+    c.compile(s->thenBranch);
+    if (!s->elseBranch)
+    {
+        c.patchJump(elseJump);
+        return;
+    }
+
+    auto endJump = c.emitJump(OpCode::JUMP, 0);
+    c.patchJump(elseJump);
+    c.compile(*s->elseBranch);
+    c.patchJump(endJump);
+}
+
+void Compiler::StmtCompileVisitor::operator()(const WhileStatement* s) const
+{
+    unsigned start = c.chunk().code.size();
+    c.compile(s->condition);
+    auto exitJump = c.emitJump(OpCode::POP_JUMP_IF_FALSE, -1);
+    c.compile(s->body);
+    c.emitLoop(start);
+    c.patchJump(exitJump);
+}
+
+void Compiler::StmtCompileVisitor::operator()(const Unit* s) const
+{
+    for (auto child : s->statements)
+        c.compile(child);
+}
@@ -1,72 +1,553 @@
 #include <include/eval.h>
 
 #include <fmt/format.h>
+#include <bit>
 #include <chrono>
+#include <cstdint>
+#include <deque>
+#include <limits>
 
 #include <include/utils.h>
 #include <include/analysis.h>
+#include <include/closure_compiler.h>
+
+#if __has_include(<sys/resource.h>)
+#include <sys/resource.h>
+#define SLOX_STACK_RLIMIT
+#endif
+
+// The native stack is checked where the address of the current frame
+// is known, elsewhere only the calls are counted.
+#if defined(__GNUC__)
+#define SLOX_STACK_PROBE
+#endif
 
 using enum TokenType;
 
 std::string print(const RuntimeValue& val)
 {
-    return std::visit([](auto&& arg) {
+    return val.visit([](auto&& arg) {
         return fmt::format("{}", arg);
-    }, val);
+    });
+}
+
+void RuntimeValue::destroy() noexcept
+{
+    if ((number.bits & tagMask) == stringTag)
+        delete static_cast<Box<String>*>(header());
+    else
+        delete static_cast<Box<Callable>*>(header());
+}
+
+String::String(std::string chars)
+    : buffer(std::make_shared<Buffer>(Buffer{std::move(chars), false})), length(buffer->chars.size())
+{}
+
+String String::intern(const std::string& chars)
+{
+    // Interned strings are never freed, only the literals of the
+    // program are interned.
+    static std::unordered_map<std::string, String> table;
+    auto it = table.find(chars);
+    if (it == table.end())
+        it = table.emplace(chars, String{std::make_shared<Buffer>(Buffer{chars, true}), chars.size()}).first;
+    return it->second;
+}
+
+std::size_t String::hash() const noexcept
+{
+    if (!cachedHash)
+        cachedHash = std::hash<std::string_view>{}(view());
+    return *cachedHash;
+}
+
+bool operator==(const String& lhs, const String& rhs) noexcept
+{
+    if (lhs.buffer == rhs.buffer)
+        return lhs.length == rhs.length;
+    if (lhs.buffer->interned && rhs.buffer->interned)
+        return false;
+    return lhs.view() == rhs.view();
+}
+
+String operator+(const String& lhs, const String& rhs)
+{
+    // Append in place when no other string ends at the end of the
+    // buffer. Appending a string to itself would read the buffer
+    // while it grows.
+    auto& chars = lhs.buffer->chars;
+    if (!lhs.buffer->interned && lhs.length == chars.size() && lhs.buffer != rhs.buffer)
+    {
+        chars.append(rhs.view());
+        return String{lhs.buffer, chars.size()};
+    }
+
+    std::string result;
+    result.reserve(lhs.size() + rhs.size());
+    result.append(lhs.view());
+    result.append(rhs.view());
+    return String{std::move(result)};
+}
+
+RuntimeValue literalValue(const Token& token)
+{
+    switch(token.type)
+    {
+        case TRUE:
+            return true;
+        case FALSE:
+            return false;
+        case NIL:
+            return Nil{};
+        default:
+            break;
+    }
+
+    return std::visit(Overloaded{
+        [](const std::string& s) -> RuntimeValue { return String::intern(s); },
+        [](double d) -> RuntimeValue { return Number::fromDouble(d); }
+    }, token.value);
 }
 
-RuntimeValue Callable::operator()(Interpreter& interp, std::vector<RuntimeValue> args) const
+std::optional<std::size_t> MemoTable::hashArguments(std::span<const RuntimeValue> args) noexcept
 {
-    return impl(interp, std::move(args));
+    std::size_t hash = args.size();
+    for (const auto& arg : args)
+    {
+        if (arg.is<Callable>())
+            return std::nullopt;
+
+        std::size_t argHash = arg.visit(Overloaded{
+            [](Nil) -> std::size_t { return 0; },
+            [](const Callable&) -> std::size_t { return 0; },
+            [](const String& s) { return s.hash(); },
+            [](Number n) { return std::hash<std::uint64_t>{}(std::bit_cast<std::uint64_t>(n.toDouble())); },
+            [](bool b) -> std::size_t { return b ? 1 : 2; }
+        });
+        hash ^= argHash + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    }
+
+    // Small integers only differ in the high bits of their
+    // representation, mix them into the bits selecting the entry.
+    std::uint64_t mixed = hash;
+    mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebULL;
+    return static_cast<std::size_t>(mixed ^ (mixed >> 31));
 }
 
-Interpreter::Interpreter(const ASTContext& ctxt, const DiagnosticEmitter& diag, Environment env)
-    : ctxt{ctxt}, diag(diag), globalEnv(std::move(env)), collectCounter(0)
+const RuntimeValue* MemoTable::find(std::span<const RuntimeValue> args, std::size_t hash) const noexcept
 {
+    if (entries.empty())
+        return nullptr;
+
+    const auto& entry = entries[hash % capacity];
+    if (!entry || entry->hash != hash || entry->args.size() != args.size())
+        return nullptr;
+
+    // Distinguish 0 and -0, they are equal but can produce different results.
+    for (unsigned i = 0; i < args.size(); ++i)
+    {
+        const auto* lhs = entry->args[i].getIf<Number>();
+        const auto* rhs = args[i].getIf<Number>();
+        if (lhs && rhs ? std::bit_cast<std::uint64_t>(lhs->toDouble()) != std::bit_cast<std::uint64_t>(rhs->toDouble())
+                       : !(entry->args[i] == args[i]))
+            return nullptr;
+    }
+    return &entry->result;
+}
+
+void MemoTable::insert(std::vector<RuntimeValue> args, std::size_t hash, RuntimeValue result)
+{
+    if (entries.empty())
+        entries.resize(capacity);
+
+    entries[hash % capacity] = Entry{hash, std::move(args), std::move(result)};
+}
+
+namespace
+{
+// Lox calls recurse on the native stack. An optimized build takes
+// about 850 bytes of it for `return f(n - 1) + 1;`, debug builds and
+// larger expressions take more, those are stopped by the check of the
+// stack in the calls.
+constexpr std::size_t nativeCallFrameSize = 1024;
+
+// Left for the frames below the interpreter and the natives.
+constexpr std::size_t nativeStackReserve = 256 * 1024;
+
+std::size_t nativeStackBudget() noexcept
+{
+#if defined(SLOX_STACK_RLIMIT)
+    constexpr std::size_t defaultSize = 8 * 1024 * 1024;
+    rlimit limit;
+    std::size_t size = defaultSize;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        size = limit.rlim_cur;
+#else
+    // The smallest default of the common platforms.
+    constexpr std::size_t size = 1024 * 1024;
+#endif
+    return size > nativeStackReserve ? size - nativeStackReserve : 0;
+}
+
+std::uintptr_t nativeStackPointer() noexcept
+{
+#if defined(SLOX_STACK_PROBE)
+    return reinterpret_cast<std::uintptr_t>(__builtin_frame_address(0));
+#else
+    return 0;
+#endif
+}
+} // anonymous namespace
+
+unsigned maxNativeCallDepth() noexcept
+{
+    auto depth = nativeStackBudget() / nativeCallFrameSize;
+    return static_cast<unsigned>(std::min<std::size_t>(depth, std::numeric_limits<unsigned>::max()));
+}
+
+Interpreter::Interpreter(const ASTContext& ctxt, const DiagnosticEmitter& diag, Options options, Environment env)
+    : ctxt{ctxt}, diag(diag), options(options), globalEnv(std::move(env)),
+      maxCallDepth(options.maxCallDepth ? options.maxCallDepth : maxNativeCallDepth()),
+      stackBudget(nativeStackBudget()),
+      resolver(ctxt, diag), collectCounter(0)
+{
+    if (options.engine == Engine::Closures)
+        closureCompiler = std::make_unique<ClosureCompiler>(ctxt, diag, globalEnv, typeFacts);
+
     // Built in functions.
     globalEnv.define("clock",
-        Callable{
-            0, &globalEnv,
-            [](Interpreter&, std::vector<RuntimeValue>&&) -> RuntimeValue
+        Callable{std::make_shared<FunctionObject>(FunctionObject{
+            0, &globalEnv, nullptr,
+            [](Interpreter&, std::span<RuntimeValue>) -> RuntimeValue
             {
-                return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+                return Number{std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count()};
             }
-        }
+        })}
     );
 }
 
+Interpreter::~Interpreter() = default;
+
 bool Interpreter::evaluate(StatementIndex stmt)
 {
+    stackBase = nativeStackPointer();
     try
     {
         // Resolve local names.
-        NameResolver resolver(ctxt, diag);
-        if(auto res = resolver.resolveVariables(stmt); res)
+        auto bodies = options.lazyResolve && !closureCompiler ? FunctionBodies::Defer : FunctionBodies::Analyze;
+        if(auto res = resolver.resolveVariables(stmt, bodies); res)
             resolution.merge(std::move(*res));
         else
             return false;
 
+        TypeInference inference(ctxt);
+        typeFacts.merge(inference.inferTypes(stmt, bodies));
+
+        if (closureCompiler)
+        {
+            closureCompiler->compileScript(stmt)(*this);
+            return true;
+        }
+
+        if (options.memoizePure)
+        {
+            PurityAnalysis purity(ctxt);
+            pureFunctions.merge(purity.findPureFunctions(stmt));
+        }
+
+        materializeLiterals();
         eval(stmt);
         return true;
     }
     catch(const RuntimeError& e)
     {
+        // Unwinding skipped popping the environments of the calls and
+        // blocks in progress.
+        stack.clear();
+        valueStack.clear();
+        callDepth = 0;
         diag.error(ctxt.getToken(e.where).line, e.message);
         return false;
     }
 }
 
+void Interpreter::materializeLiterals()
+{
+    // The context only grows between evaluations, the values of the
+    // literals are computed once.
+    for (unsigned id = literalPool.size(); id < ctxt.getLiteralCount(); ++id)
+    {
+        const auto* l = std::get<const Literal*>(ctxt.getNode(Index<Literal>{id}));
+        literalPool.push_back(literalValue(ctxt.getToken(l->value)));
+    }
+}
+
+void Interpreter::resolveFunction(const FunDecl& decl)
+{
+    if (resolvedFunctions.contains(decl.name))
+        return;
+
+    // Failing bodies stay unresolved, so every call reports the error.
+    try
+    {
+        resolution.merge(resolver.resolveFunction(decl));
+    }
+    catch (const CompileTimeError& e)
+    {
+        throw RuntimeError{e.where, e.message};
+    }
+
+    TypeInference inference(ctxt);
+    typeFacts.merge(inference.inferTypes(decl));
+    resolvedFunctions.insert(decl.name);
+}
+
+RuntimeValue Interpreter::call(FunctionObject& fn, std::span<RuntimeValue> args, Index<Token> site)
+{
+    // The stack grows down. The frames might be larger than estimated
+    // by the default limit, the native stack is checked too.
+    if (callDepth == maxCallDepth || stackBase - nativeStackPointer() > stackBudget)
+        throw RuntimeError{site, "Stack overflow."};
+
+    ++callDepth;
+    auto result = invoke(fn, args);
+    --callDepth;
+    return result;
+}
+
+RuntimeValue Interpreter::invoke(FunctionObject& fn, std::span<RuntimeValue> args)
+{
+    if (fn.native)
+        return fn.native(*this, args);
+    if (!fn.decl)
+        return fn.compiled(*this, args);
+
+    if (!fn.resolved)
+    {
+        resolveFunction(*fn.decl);
+        fn.resolved = true;
+    }
+
+    if (!fn.memo)
+        return callDeclared(fn, args);
+
+    auto hash = MemoTable::hashArguments(args);
+    if (!hash)
+        return callDeclared(fn, args);
+
+    if (const auto* cached = fn.memo->find(args, *hash))
+        return *cached;
+
+    std::vector<RuntimeValue> key(args.begin(), args.end());
+    auto result = callDeclared(fn, args);
+    fn.memo->insert(std::move(key), *hash, result);
+    return result;
+}
+
+RuntimeValue Interpreter::callDeclared(const FunctionObject& fn, std::span<RuntimeValue> args)
+{
+    // Tail calls run in this loop once the environment of the returning
+    // function is popped, so the stacks do not grow and the collector
+    // can free the environments.
+    const FunctionObject* current = &fn;
+    std::shared_ptr<FunctionObject> tailCallee;
+
+    // Memoized functions replaced by a tail call get the final result.
+    // Only the last calls are kept, older ones would be evicted anyway.
+    struct PendingResult
+    {
+        std::shared_ptr<FunctionObject> fn;
+        std::vector<RuntimeValue> args;
+        std::size_t hash;
+    };
+    std::deque<PendingResult> pending;
+    auto memoize = [&pending](RuntimeValue result) {
+        for (auto& p : pending)
+            p.fn->memo->insert(std::move(p.args), p.hash, result);
+        return result;
+    };
+
+    while (true)
+    {
+        auto* newEnv = pushEnv(current->closure);
+
+        // Bind arguments.
+        const auto& params = current->decl->params;
+        for (unsigned i = 0; i < params.size(); ++i)
+            newEnv->define(std::get<std::string>(ctxt.getToken(params[i]).value), std::move(args[i]));
+
+        if (tailCallee)
+        {
+            valueStack.resize(tailCallBase);
+            collect();
+        }
+
+        Completion completion = Completion::Normal;
+        for (auto stmt : current->decl->body)
+        {
+            completion = eval(stmt);
+            if (completion != Completion::Normal)
+                break;
+        }
+
+        popEnv();
+        if (completion == Completion::Normal)
+            return memoize(Nil{});
+        if (completion == Completion::Return)
+            return memoize(std::move(returnValue));
+
+        tailCallee = valueStack[tailCallBase].get<Callable>().fn;
+        if (!tailCallee->resolved)
+        {
+            resolveFunction(*tailCallee->decl);
+            tailCallee->resolved = true;
+        }
+        current = tailCallee.get();
+        args = std::span(valueStack).subspan(tailCallBase + 1);
+
+        if (!tailCallee->memo)
+            continue;
+        auto hash = MemoTable::hashArguments(args);
+        if (!hash)
+            continue;
+        if (const auto* cached = tailCallee->memo->find(args, *hash))
+        {
+            auto result = *cached;
+            valueStack.resize(tailCallBase);
+            return memoize(result);
+        }
+        pending.push_back({tailCallee, std::vector<RuntimeValue>(args.begin(), args.end()), *hash});
+        if (pending.size() > MemoTable::capacity)
+            pending.pop_front();
+    }
+}
+
 bool Interpreter::isTruthy(const RuntimeValue& val)
 {
-    if (const auto* boolVal = std::get_if<bool>(&val))
-        return *boolVal;
+    if (val.is<bool>())
+        return val.get<bool>();
+
+    return !val.is<Nil>();
+}
+
+Quickening& Interpreter::quickeningOf(std::vector<Quickening>& states, unsigned id)
+{
+    if (id >= states.size())
+        states.resize(id + 1);
+    return states[id];
+}
+
+Fusion Interpreter::fusionOf(Index<Binary> idx, const Binary& b)
+{
+    if (idx.id >= binaryFusions.size())
+        binaryFusions.resize(idx.id + 1);
+    auto& fusion = binaryFusions[idx.id];
+    if (!fusion.planned)
+        fusion = Fusion{true, planOperand(b.left), planOperand(b.right)};
+    return fusion;
+}
+
+FusedOperand Interpreter::planOperand(ExpressionIndex expr) const
+{
+    auto node = ctxt.getNode(expr);
+    if (const auto* ref = std::get_if<const DeclRef*>(&node))
+        return FusedOperand{FusedOperand::Kind::Variable, distanceOf(expr), (*ref)->name};
+
+    if (const auto* lit = std::get_if<const Literal*>(&node))
+    {
+        const auto& token = ctxt.getToken((*lit)->value);
+        if (token.type == NUMBER)
+            return FusedOperand{FusedOperand::Kind::Number, -1, (*lit)->value,
+                                Number::fromDouble(std::get<double>(token.value))};
+    }
+
+    return FusedOperand{};
+}
+
+RuntimeValue Interpreter::evalOperand(const FusedOperand& operand, ExpressionIndex expr)
+{
+    switch (operand.kind)
+    {
+        case FusedOperand::Kind::Variable:
+            return readVariable(operand.name, operand.distance);
+        case FusedOperand::Kind::Number:
+            return operand.number;
+        case FusedOperand::Kind::Node:
+            break;
+    }
+    return eval(expr);
+}
+
+int Interpreter::assignDistanceOf(Index<Assign> idx)
+{
+    if (idx.id >= assignDistances.size())
+        assignDistances.resize(idx.id + 1, -2);
+    auto& distance = assignDistances[idx.id];
+    if (distance < -1)
+        distance = distanceOf(idx);
+    return distance;
+}
+
+int Interpreter::refDistanceOf(Index<DeclRef> idx)
+{
+    if (idx.id >= refDistances.size())
+        refDistances.resize(idx.id + 1, -2);
+    auto& distance = refDistances[idx.id];
+    if (distance < -1)
+        distance = distanceOf(idx);
+    return distance;
+}
+
+int Interpreter::distanceOf(ExpressionIndex expr) const noexcept
+{
+    auto it = resolution.find(expr);
+    return it == resolution.end() ? -1 : it->second;
+}
+
+RuntimeValue& Interpreter::assignTarget(const Assign& a, Index<Assign> idx)
+{
+    const auto& varName = std::get<std::string>(ctxt.getToken(a.name).value);
+    int distance = assignDistanceOf(idx);
+
+    // Assume it is a global when it is not resolved.
+    auto* target = distance < 0 ? globalEnv.find(varName) : getCurrentEnv().findAt(distance, varName);
+    if (!target)
+        throw RuntimeError{a.name, fmt::format("Undefined variable: '{}'.", varName)};
+    return *target;
+}
+
+RuntimeValue Interpreter::readVariable(Index<Token> name, int distance)
+{
+    // Assume it is a global when it is not resolved.
+    if (distance < 0)
+        return readGlobal(name);
+
+    const auto& varName = std::get<std::string>(ctxt.getToken(name).value);
+    if (auto val = getCurrentEnv().getAt(distance, varName))
+        return *val;
+
+    throw RuntimeError{name, fmt::format("Undefined variable: '{}'.", varName)};
+}
 
-    return !std::get_if<Nil>(&val);
+const RuntimeValue& Interpreter::readGlobal(Index<Token> name)
+{
+    if (name.id >= globalCells.size())
+        globalCells.resize(name.id + 1, nullptr);
+    auto& cell = globalCells[name.id];
+    if (cell)
+        return *cell;
+
+    const auto& varName = std::get<std::string>(ctxt.getToken(name).value);
+    cell = globalEnv.find(varName);
+    if (!cell)
+        throw RuntimeError{name, fmt::format("Undefined variable: '{}'.", varName)};
+    return *cell;
 }
 
 void Interpreter::checkNumberOperand(const RuntimeValue& val, Index<Token> token)
 {
-    if (!std::get_if<double>(&val))
+    if (!val.getIf<Number>())
         throw RuntimeError{token, "Operand must evaluate to a number."};
 }
 
@@ -77,48 +558,42 @@ RuntimeValue Interpreter::eval(ExpressionIndex expr)
     return std::visit(exprVisitor, node);
 }
 
-void Interpreter::eval(StatementIndex stmt)
+Completion Interpreter::eval(StatementIndex stmt)
 {
     auto node = ctxt.getNode(stmt);
-    std::visit(stmtVisitor, node);
+    return std::visit(stmtVisitor, node);
 }
 
-RuntimeValue Interpreter::ExprEvalVisitor::operator()(const Literal* l) const
+RuntimeValue Interpreter::ExprEvalVisitor::operator()(const Literal*) const
 {
-    const auto& token = i.ctxt.getToken(l->value);
-
-    switch(token.type)
-    {
-        case TRUE:
-            return true;
-        case FALSE:
-            return false;
-        case NIL:
-            return Nil{};
-        default:
-            break;
-    }
-
-    return std::visit([](auto&& arg) -> RuntimeValue {
-        return arg;
-    }, token.value);
+    return i.literalPool[std::get<Index<Literal>>(i.currentExpr).id];
 }
 
 RuntimeValue Interpreter::ExprEvalVisitor::operator()(const Unary* u) const
 {
+    auto self = std::get<Index<Unary>>(i.currentExpr);
     RuntimeValue inner = i.eval(u->subExpr);
     
-    switch (i.ctxt.getToken(u->op).type)
+    switch (u->kind)
+    {
+    case UnaryOp::Negate:
     {
-    case MINUS:
+        if (i.typeFacts.operandsOf(self) == StaticType::Number)
+            return -inner.get<Number>();
+
+        // Only the operand type is guarded once the node specialized.
+        auto& quickening = quickeningOf(i.unaryQuickening, self.id);
+        const auto* number = inner.getIf<Number>();
+        if (quickening == Quickening::Number && number)
+            return -*number;
+        quickening = quickening == Quickening::Unseen && number ? Quickening::Number : Quickening::Generic;
+
         checkNumberOperand(inner, u->op);
-        return -std::get<double>(inner);
+        return -inner.get<Number>();
+    }
 
-    case BANG:
+    case UnaryOp::Not:
         return !isTruthy(inner);
-    
-    default:
-        break;
     }
 
     throw RuntimeError{u->op, "Unexpected unary operator."};
@@ -126,69 +601,154 @@ RuntimeValue Interpreter::ExprEvalVisitor::operator()(const Unary* u) const
 
 RuntimeValue Interpreter::ExprEvalVisitor::operator()(const Binary* b) const
 {
-    RuntimeValue left = i.eval(b->left);
+    auto self = std::get<Index<Binary>>(i.currentExpr);
 
     // Short circut for logical operators.
-    auto type = i.ctxt.getToken(b->op).type;
-    if (type == OR)
+    auto type = b->kind;
+    if (type == BinaryOp::Or)
     {
+        RuntimeValue left = i.eval(b->left);
         if (isTruthy(left))
             return left;
         return i.eval(b->right);
     }
-    if (type == AND)
+    if (type == BinaryOp::And)
     {
+        RuntimeValue left = i.eval(b->left);
         if (!isTruthy(left))
             return left;
         return i.eval(b->right);
     }
 
-    RuntimeValue right = i.eval(b->right);
+    // The operands can grow the table, keep a copy.
+    Fusion fusion = i.fusionOf(self, *b);
+    RuntimeValue left = i.evalOperand(fusion.left, b->left);
+    RuntimeValue right = i.evalOperand(fusion.right, b->right);
+
+    // Operands of statically known types need no checks.
+    switch (i.typeFacts.operandsOf(self))
+    {
+        case StaticType::Number:
+        {
+            Number l = left.get<Number>();
+            Number r = right.get<Number>();
+            switch (type)
+            {
+                case BinaryOp::Divide: return l / r;
+                case BinaryOp::Multiply: return l * r;
+                case BinaryOp::Subtract: return l - r;
+                case BinaryOp::Add: return l + r;
+                case BinaryOp::Greater: return l > r;
+                case BinaryOp::GreaterEqual: return l >= r;
+                case BinaryOp::Less: return l < r;
+                case BinaryOp::LessEqual: return l <= r;
+                case BinaryOp::Equal: return l == r;
+                default: break;
+            }
+            break;
+        }
+        case StaticType::String:
+            if (type == BinaryOp::Add)
+                return *left.getIf<String>() + *right.getIf<String>();
+            break;
+        default:
+            break;
+    }
+
+    // Operators specialize to the operand types they observed, the
+    // specialized paths only guard the types. The state is looked up
+    // after the operands are evaluated, those can grow the table.
+    auto& quickening = quickeningOf(i.binaryQuickening, self.id);
+    const auto* leftNumber = left.getIf<Number>();
+    const auto* rightNumber = right.getIf<Number>();
+    const auto* leftString = left.getIf<String>();
+    const auto* rightString = right.getIf<String>();
+    switch (quickening)
+    {
+        case Quickening::Number:
+            if (leftNumber && rightNumber)
+            {
+                switch (type)
+                {
+                    case BinaryOp::Divide: return *leftNumber / *rightNumber;
+                    case BinaryOp::Multiply: return *leftNumber * *rightNumber;
+                    case BinaryOp::Subtract: return *leftNumber - *rightNumber;
+                    case BinaryOp::Add: return *leftNumber + *rightNumber;
+                    case BinaryOp::Greater: return *leftNumber > *rightNumber;
+                    case BinaryOp::GreaterEqual: return *leftNumber >= *rightNumber;
+                    case BinaryOp::Less: return *leftNumber < *rightNumber;
+                    case BinaryOp::LessEqual: return *leftNumber <= *rightNumber;
+                    case BinaryOp::Equal: return *leftNumber == *rightNumber;
+                    default: break;
+                }
+            }
+            quickening = Quickening::Generic;
+            break;
+        case Quickening::String:
+            if (leftString && rightString)
+            {
+                if (type == BinaryOp::Add)
+                    return *leftString + *rightString;
+                return *leftString == *rightString;
+            }
+            quickening = Quickening::Generic;
+            break;
+        case Quickening::Unseen:
+            if (leftNumber && rightNumber)
+                quickening = Quickening::Number;
+            else if (leftString && rightString && (type == BinaryOp::Add || type == BinaryOp::Equal))
+                quickening = Quickening::String;
+            else
+                quickening = Quickening::Generic;
+            break;
+        case Quickening::Generic:
+            break;
+    }
 
     switch (type)
     {
         // Arithmetic.
-        case SLASH:
+        case BinaryOp::Divide:
             checkNumberOperand(left, b->op);
             checkNumberOperand(right, b->op);
-            return std::get<double>(left) / std::get<double>(right);
-        case STAR:
+            return left.get<Number>() / right.get<Number>();
+        case BinaryOp::Multiply:
             checkNumberOperand(left, b->op);
             checkNumberOperand(right, b->op);
-            return std::get<double>(left) * std::get<double>(right);
-        case MINUS:
+            return left.get<Number>() * right.get<Number>();
+        case BinaryOp::Subtract:
             checkNumberOperand(left, b->op);
             checkNumberOperand(right, b->op);
-            return std::get<double>(left) - std::get<double>(right);
-        case PLUS:
+            return left.get<Number>() - right.get<Number>();
+        case BinaryOp::Add:
             if (left.index() != right.index())
                 throw RuntimeError{b->op, "Operands' type mismatch."};
 
-            if (std::get_if<double>(&left))
-                return std::get<double>(left) + std::get<double>(right);
-            if (std::get_if<std::string>(&left))
-                return std::get<std::string>(left) + std::get<std::string>(right);
+            if (left.getIf<Number>())
+                return left.get<Number>() + right.get<Number>();
+            if (left.getIf<String>())
+                return left.get<String>() + right.get<String>();
 
             throw RuntimeError{b->op, "Operands with unsupported type."};
 
         // Comparison.
-        case GREATER:
+        case BinaryOp::Greater:
             checkNumberOperand(left, b->op);
             checkNumberOperand(right, b->op);
-            return std::get<double>(left) > std::get<double>(right);
-        case GREATER_EQUAL:
+            return left.get<Number>() > right.get<Number>();
+        case BinaryOp::GreaterEqual:
             checkNumberOperand(left, b->op);
             checkNumberOperand(right, b->op);
-            return std::get<double>(left) >= std::get<double>(right);
-        case LESS:
+            return left.get<Number>() >= right.get<Number>();
+        case BinaryOp::Less:
             checkNumberOperand(left, b->op);
             checkNumberOperand(right, b->op);
-            return std::get<double>(left) < std::get<double>(right);
-        case LESS_EQUAL:
+            return left.get<Number>() < right.get<Number>();
+        case BinaryOp::LessEqual:
             checkNumberOperand(left, b->op);
             checkNumberOperand(right, b->op);
-            return std::get<double>(left) <= std::get<double>(right);
-        case EQUAL_EQUAL:
+            return left.get<Number>() <= right.get<Number>();
+        case BinaryOp::Equal:
             return left == right;
 
         default:
@@ -200,23 +760,11 @@ RuntimeValue Interpreter::ExprEvalVisitor::operator()(const Binary* b) const
 
 RuntimeValue Interpreter::ExprEvalVisitor::operator()(const Assign* a) const
 {
+    // Evaluating the value overwrites the current expression.
+    auto self = std::get<Index<Assign>>(i.currentExpr);
     RuntimeValue value = i.eval(a->value);
-    const auto& varName = std::get<std::string>(i.ctxt.getToken(a->name).value);
-
-    auto it = i.resolution.find(i.currentExpr);
-    if (it == i.resolution.end())
-    {
-        // Assume it is a global
-        if (i.globalEnv.assign(varName, value))
-            return value;
-    }
-    else
-    {
-        if (i.getCurrentEnv().assignAt(it->second, varName, value))
-            return value;
-    }
-
-    throw RuntimeError{a->name, fmt::format("Undefined variable: '{}'.", varName)};
+    i.assignTarget(*a, self) = value;
+    return value;
 }
 
 RuntimeValue Interpreter::ExprEvalVisitor::operator()(const Grouping* g) const
@@ -226,59 +774,83 @@ RuntimeValue Interpreter::ExprEvalVisitor::operator()(const Grouping* g) const
 
 RuntimeValue Interpreter::ExprEvalVisitor::operator()(const DeclRef* r) const
 {
-    const auto& name = std::get<std::string>(i.ctxt.getToken(r->name).value);
-    auto it = i.resolution.find(i.currentExpr);
-    if (it == i.resolution.end())
+    return i.readVariable(r->name, i.refDistanceOf(std::get<Index<DeclRef>>(i.currentExpr)));
+}
+
+std::size_t Interpreter::pushCall(const Call& c, Index<Call> idx)
+{
+    RuntimeValue callee = eval(c.callee);
+
+    // Call sites remember the declaration of their last callee, calling
+    // it again needs no checks. Declarations are never freed and fix
+    // the arity.
+    if (idx.id >= checkedCallees.size())
+        checkedCallees.resize(idx.id + 1, nullptr);
+    auto& checked = checkedCallees[idx.id];
+    Callable* callable = callee.getIf<Callable>();
+    if (!callable || !checked || callable->fn->decl != checked)
     {
-        // Assume it is a global
-        if (auto val = i.globalEnv.get(name))
-            return *val;
+        if (!callable)
+            throw RuntimeError{c.open, "Can only call functions and classes."};
+
+        if (callable->fn->arity != c.args.size())
+            throw RuntimeError{c.open,
+                fmt::format("Expected {} arguments but got {}.", callable->fn->arity, c.args.size())};
+        checked = callable->fn->decl;
     }
-    else
+
+    // The callee and the arguments stay on the value stack until
+    // the callee takes them, the result while collecting. Values
+    // on the stack keep their closures alive.
+    auto base = valueStack.size();
+    valueStack.push_back(std::move(callee));
+    for(auto arg : c.args)
     {
-        if (auto val = i.getCurrentEnv().getAt(it->second, name))
-            return *val;
+        valueStack.push_back(eval(arg));
     }
+    return base;
+}
 
-    throw RuntimeError{r->name, fmt::format("Undefined variable: '{}'.", name)};
+RuntimeValue Interpreter::finishCall(std::size_t base, Index<Token> site)
+{
+    auto& fn = *valueStack[base].get<Callable>().fn;
+    valueStack[base] = call(fn, std::span(valueStack).subspan(base + 1), site);
+    valueStack.resize(base + 1);
+    collect();
+    RuntimeValue retVal = std::move(valueStack[base]);
+    valueStack.resize(base);
+    return retVal;
 }
 
 RuntimeValue Interpreter::ExprEvalVisitor::operator()(const Call* c) const
 {
-    RuntimeValue callee = i.eval(c->callee);
-
-    if (Callable* callable = get_if<Callable>(&callee))
-    {
-        if (callable->arity != c->args.size())
-            throw RuntimeError{c->open,
-                fmt::format("Expected {} arguments but got {}.", callable->arity, c->args.size())};
-
-        std::vector<RuntimeValue> argValues;
-        for(auto arg : c->args)
-        {
-            argValues.push_back(i.eval(arg));
-        }
-
-        auto retVal = (*callable)(i, std::move(argValues));
-        i.collect();
-        return retVal;
-    }
-
-    throw RuntimeError{c->open, "Can only call functions and classes."};
+    return i.finishCall(i.pushCall(*c, std::get<Index<Call>>(i.currentExpr)), c->open);
 }
 
-void Interpreter::StmtEvalVisitor::operator()(const PrintStatement* s) const
+Completion Interpreter::StmtEvalVisitor::operator()(const PrintStatement* s) const
 {
     RuntimeValue value = i.eval(s->subExpr);
     i.diag.getOutput() << print(value) << '\n';
+    return Completion::Normal;
 }
 
-void Interpreter::StmtEvalVisitor::operator()(const ExprStatement* s) const
+Completion Interpreter::StmtEvalVisitor::operator()(const ExprStatement* s) const
 {
+    // The result of an assignment statement is unused, the value is
+    // moved into the variable.
+    if (const auto* idx = std::get_if<Index<Assign>>(&s->subExpr))
+    {
+        const auto* a = std::get<const Assign*>(i.ctxt.getNode(*idx));
+        RuntimeValue value = i.eval(a->value);
+        i.assignTarget(*a, *idx) = std::move(value);
+        return Completion::Normal;
+    }
+
     i.eval(s->subExpr);
+    return Completion::Normal;
 }
 
-void Interpreter::StmtEvalVisitor::operator()(const VarDecl* s) const
+Completion Interpreter::StmtEvalVisitor::operator()(const VarDecl* s) const
 {
     RuntimeValue val;
     if (s->init)
@@ -286,96 +858,93 @@ void Interpreter::StmtEvalVisitor::operator()(const VarDecl* s) const
     else
         val = Nil{};
 
-    i.getCurrentEnv().define(std::get<std::string>(i.ctxt.getToken(s->name).value), val);
+    i.getCurrentEnv().define(std::get<std::string>(i.ctxt.getToken(s->name).value), std::move(val));
+    return Completion::Normal;
 }
 
-void Interpreter::StmtEvalVisitor::operator()(const FunDecl* s) const
+Completion Interpreter::StmtEvalVisitor::operator()(const FunDecl* s) const
 {
-    Callable callable{
-        static_cast<unsigned>(s->params.size()),
-        &i.getCurrentEnv(),
-        [&params = s->params, body = s->body, closure = &i.getCurrentEnv()](
-            Interpreter& interp,
-            std::vector<RuntimeValue> args) -> RuntimeValue
-        {
-            auto *newEnv = interp.pushEnv(closure);
-
-            // Bind arguments.
-            for(unsigned i = 0; i < params.size(); ++i)
-            {
-                newEnv->define(std::get<std::string>(interp.ctxt.getToken(params[i]).value), args[i]);
-            }
+    auto fn = std::make_shared<FunctionObject>(FunctionObject{
+        static_cast<unsigned>(s->params.size()), &i.getCurrentEnv(), s});
 
-            try
-            {
-                for (auto stmt : body)
-                {
-                    interp.eval(stmt);
-                }
-            }
-            catch (const ReturnValue& retVal)
-            {
-                interp.popEnv();
-                return retVal.value ? *retVal.value : Nil{};
-            }
+    // Only the bodies of global functions are deferred.
+    if (i.options.lazyResolve && i.stack.empty())
+        fn->resolved = false;
 
-            interp.popEnv();
-            return Nil{};
-        }
-    };
+    if (i.pureFunctions.contains(s->name))
+        fn->memo = std::make_unique<MemoTable>();
 
-    i.getCurrentEnv().define(std::get<std::string>(i.ctxt.getToken(s->name).value), callable);
+    i.getCurrentEnv().define(std::get<std::string>(i.ctxt.getToken(s->name).value), Callable{std::move(fn)});
+    return Completion::Normal;
 }
 
-void Interpreter::StmtEvalVisitor::operator()(const Return* s) const
+Completion Interpreter::StmtEvalVisitor::operator()(const Return* s) const
 {
-    if (s->value)
-        throw ReturnValue{i.eval(*s->value)};
+    // Returning the result of a call is a tail call. Natives and
+    // compiled functions are called here.
+    auto value = s->value ? std::optional(i.ctxt.getNode(*s->value)) : std::nullopt;
+    if (const auto* call = value ? std::get_if<const Call*>(&*value) : nullptr)
+    {
+        auto base = i.pushCall(**call, std::get<Index<Call>>(*s->value));
+        const auto& fn = *i.valueStack[base].get<Callable>().fn;
+        if (fn.decl)
+        {
+            i.tailCallBase = base;
+            return Completion::TailCall;
+        }
+
+        i.returnValue = i.finishCall(base, (*call)->open);
+        return Completion::Return;
+    }
 
-    throw ReturnValue{std::nullopt};
+    i.returnValue = s->value ? i.eval(*s->value) : Nil{};
+    return Completion::Return;
 }
 
-void Interpreter::StmtEvalVisitor::operator()(const Block* s) const
+Completion Interpreter::StmtEvalVisitor::operator()(const Block* s) const
 {
     i.pushEnv(&i.getCurrentEnv());
 
-    try
+    for (auto child : s->statements)
     {
-        for (auto child : s->statements)
+        if (auto completion = i.eval(child); completion != Completion::Normal)
         {
-            i.eval(child);
+            i.popEnv();
+            return completion;
         }
     }
-    catch(...)
-    {
-        // Return values are passed by exceptions, so we need to catch
-        // them to ensure popping env. We should switch to a different
-        // return mechanism.
-        i.popEnv();
-        throw;
-    }
 
     i.popEnv();
+    return Completion::Normal;
 }
 
-void Interpreter::StmtEvalVisitor::operator()(const IfStatement* s) const
+Completion Interpreter::StmtEvalVisitor::operator()(const IfStatement* s) const
 {
     if (isTruthy(i.eval(s->condition)))
-        i.eval(s->thenBranch);
-    else if (s->elseBranch)
-        i.eval(*s->elseBranch);
+        return i.eval(s->thenBranch);
+    if (s->elseBranch)
+        return i.eval(*s->elseBranch);
+    return Completion::Normal;
 }
 
-void Interpreter::StmtEvalVisitor::operator()(const WhileStatement* s) const
+Completion Interpreter::StmtEvalVisitor::operator()(const WhileStatement* s) const
 {
     while (isTruthy(i.eval(s->condition)))
-        i.eval(s->body);
+    {
+        if (auto completion = i.eval(s->body); completion != Completion::Normal)
+            return completion;
+    }
+    return Completion::Normal;
 }
 
-void Interpreter::StmtEvalVisitor::operator()(const Unit* s) const
+Completion Interpreter::StmtEvalVisitor::operator()(const Unit* s) const
 {
     for (auto stmt : s->statements)
-        i.eval(stmt);
+    {
+        if (auto completion = i.eval(stmt); completion != Completion::Normal)
+            return completion;
+    }
+    return Completion::Normal;
 }
 
 void Interpreter::collect()
@@ -384,7 +953,17 @@ void Interpreter::collect()
     {
         collectCounter = 0;
         std::unordered_set<Environment*> reached;
-        std::vector<Environment*> exploring{&getCurrentEnv()};
+        // Environments of the callers are still in use, so are the
+        // closures on the value stack.
+        std::vector<Environment*> exploring(stack.begin(), stack.end());
+        exploring.push_back(&globalEnv);
+        for (const auto& val : valueStack)
+        {
+            // Arguments taken by the callee are moved from.
+            const auto* callable = val.getIf<Callable>();
+            if (callable && callable->fn)
+                exploring.push_back(callable->fn->closure);
+        }
         while(!exploring.empty())
         {
             auto* env = exploring.back();
@@ -403,9 +982,9 @@ void Interpreter::collect()
 
             for(auto& [_, val] : env->values)
             {
-                if (auto* callable = std::get_if<Callable>(&val))
+                if (auto* callable = val.getIf<Callable>())
                 {
-                    auto* calledableEnv = callable->closure;
+                    auto* calledableEnv = callable->fn->closure;
                     if (reached.contains(calledableEnv))
                         continue;
                     reached.insert(calledableEnv);
@@ -3,6 +3,7 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <optional>
 
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -12,13 +13,16 @@
 #include <include/ast.h>
 #include <include/parser.h>
 #include <include/eval.h>
+#include <include/analysis.h>
+#include <include/optimizer.h>
+#include <include/vm.h>
 
-bool runFile(std::string_view path, bool dumpAst)
+bool runFile(std::string_view path, const Options& options)
 {
-    return runFile(path, std::cout, std::cerr, dumpAst);
+    return runFile(path, std::cout, std::cerr, options);
 }
 
-bool runFile(std::string_view path, std::ostream& out, std::ostream& err, bool dumpAst)
+bool runFile(std::string_view path, std::ostream& out, std::ostream& err, const Options& options)
 {
     std::ifstream file(path.data());
     if (!file) 
@@ -28,15 +32,15 @@ bool runFile(std::string_view path, std::ostream& out, std::ostream& err, bool d
     //       the full source text in memory.
     std::stringstream buffer;
     buffer << file.rdbuf();
-    return runSource(std::move(buffer).str(), out, err, dumpAst);
+    return runSource(std::move(buffer).str(), out, err, options);
 }
 
-bool runSource(std::string sourceText, bool dumpAst)
+bool runSource(std::string sourceText, const Options& options)
 {
-    return runSource(std::move(sourceText), std::cout, std::cerr, dumpAst);
+    return runSource(std::move(sourceText), std::cout, std::cerr, options);
 }
 
-bool runSource(std::string sourceText, std::ostream& out, std::ostream& err, bool dumpAst)
+bool runSource(std::string sourceText, std::ostream& out, std::ostream& err, const Options& options)
 {
     DiagnosticEmitter emitter(out, err);
     Lexer lexer(std::move(sourceText), emitter);
@@ -50,14 +54,41 @@ bool runSource(std::string sourceText, std::ostream& out, std::ostream& err, boo
     if (!maybeAst)
         return false;
 
-    if (dumpAst)
+    // Pruning drops the static errors of the dead branches, so the
+    // program is resolved as written first. Lazily resolved bodies
+    // report their errors when called, their branches are kept.
+    bool pruneBranches = !options.lazyResolve;
+    if (options.checkOnly || pruneBranches)
+    {
+        NameResolver resolver(parser.getContext(), emitter);
+        if (!resolver.resolveVariables(*maybeAst))
+            return false;
+        if (options.checkOnly)
+            return true;
+    }
+
+    // The whole program is known here, unlike in the prompt where
+    // later inputs could rebind the functions we inlined.
+    auto unit = propagateConstants(parser.getContext(), *maybeAst, pruneBranches);
+    if (options.specialize)
+        unit = specializeCalls(parser.getContext(), unit, pruneBranches);
+    unit = inlineCalls(parser.getContext(), unit);
+    unit = hoistLoopInvariants(parser.getContext(), unit);
+
+    if (options.dumpAst)
     {
         ASTPrinter printer(parser.getContext());
-        fmt::print("{}\n", printer.print(*maybeAst));
+        fmt::print("{}\n", printer.print(unit));
     }
 
-    Interpreter interpreter(parser.getContext(), emitter);
-    return interpreter.evaluate(*maybeAst);
+    if (options.engine == Engine::VM)
+    {
+        VM vm(parser.getContext(), emitter, options.maxCallDepth);
+        return vm.evaluate(unit);
+    }
+
+    Interpreter interpreter(parser.getContext(), emitter, options);
+    return interpreter.evaluate(unit);
 }
 
 namespace
@@ -79,19 +110,29 @@ std::string getPrompt(int indent)
 }
 } // anonymous namespace
 
-bool runPrompt(bool dumpAst)
+bool runPrompt(const Options& options)
 {
-    return runPrompt(std::cin, std::cout, std::cerr, dumpAst);
+    return runPrompt(std::cin, std::cout, std::cerr, options);
 }
 
-bool runPrompt(std::istream& in, std::ostream& out, std::ostream& err, bool dumpAst)
+bool runPrompt(std::istream& in, std::ostream& out, std::ostream& err, const Options& options)
 {
     std::string line;
     int indent = 0;
 
     DiagnosticEmitter emitter(out, err);
     Parser parser(emitter);
-    Interpreter interpreter(parser.getContext(), emitter);
+
+    // Later inputs can rebind any global, so we cannot prove
+    // functions to be pure.
+    Options promptOptions = options;
+    promptOptions.memoizePure = false;
+    std::optional<Interpreter> interpreter;
+    std::optional<VM> vm;
+    if (options.engine == Engine::VM)
+        vm.emplace(parser.getContext(), emitter, options.maxCallDepth);
+    else
+        interpreter.emplace(parser.getContext(), emitter, promptOptions);
 
     while (true)
     {
@@ -129,13 +170,13 @@ bool runPrompt(std::istream& in, std::ostream& out, std::ostream& err, bool dump
         if (!maybeAst)
             return false;
 
-        if (dumpAst)
+        if (options.dumpAst)
         {
             ASTPrinter printer(parser.getContext());
             fmt::print("{}\n",printer.print(*maybeAst));
         }
 
-        if (!interpreter.evaluate(*maybeAst))
+        if (!(vm ? vm->evaluate(*maybeAst) : interpreter->evaluate(*maybeAst)))
             return false;
     }
     return true;
@@ -234,6 +234,7 @@ namespace {
 const std::unordered_map<std::string_view, TokenType> keywords = {
     {tokenTypeToSourceName(AND),    AND},
     {tokenTypeToSourceName(CLASS),  CLASS},
+    {tokenTypeToSourceName(CONST),  CONST},
     {tokenTypeToSourceName(ELSE),   ELSE},
     {tokenTypeToSourceName(FALSE),  FALSE},
     {tokenTypeToSourceName(FOR),    FOR},
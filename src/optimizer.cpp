@@ -0,0 +1,1457 @@
+#include <include/optimizer.h>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <unordered_set>
+
+#include <include/utils.h>
+#include <include/analysis.h>
+
+using enum TokenType;
+
+namespace
+{
+// The factories of the context might reallocate the storage, so
+// the rewriters work on copies of the nodes.
+template<typename T>
+T copyOf(const ASTContext& ctxt, Index<T> idx)
+{
+    if constexpr (std::is_constructible_v<ExpressionIndex, Index<T>>)
+        return *std::get<const T*>(ctxt.getNode(ExpressionIndex{idx}));
+    else
+        return *std::get<const T*>(ctxt.getNode(StatementIndex{idx}));
+}
+} // anonymous namespace
+
+ExpressionIndex ASTRewriter::rewrite(ExpressionIndex expr)
+{
+    return rewriteChildren(expr);
+}
+
+StatementIndex ASTRewriter::rewrite(StatementIndex stmt)
+{
+    return rewriteChildren(stmt);
+}
+
+ExpressionIndex ASTRewriter::rewriteChildren(ExpressionIndex expr)
+{
+    return std::visit(exprVisitor, expr);
+}
+
+StatementIndex ASTRewriter::rewriteChildren(StatementIndex stmt)
+{
+    return std::visit(stmtVisitor, stmt);
+}
+
+bool ASTRewriter::isLocal(const std::string& name) const noexcept
+{
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it)
+    {
+        if (it->contains(name))
+            return true;
+    }
+    return false;
+}
+
+bool ASTRewriter::isDefinedLocal(const std::string& name) const noexcept
+{
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it)
+    {
+        if (auto found = it->find(name); found != it->end())
+            return found->second.defined;
+    }
+    return false;
+}
+
+std::optional<Index<Token>> ASTRewriter::localDeclaration(const std::string& name) const noexcept
+{
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it)
+    {
+        if (auto found = it->find(name); found != it->end())
+            return found->second.declaration;
+    }
+    return std::nullopt;
+}
+
+void ASTRewriter::declare(Index<Token> tok)
+{
+    if (scopes.empty())
+        return;
+    scopes.back().insert_or_assign(nameOf(tok), LocalBinding{tok, false});
+}
+
+void ASTRewriter::define(Index<Token> tok)
+{
+    if (scopes.empty())
+        return;
+    scopes.back().insert_or_assign(nameOf(tok), LocalBinding{tok, true});
+}
+
+std::vector<StatementIndex> ASTRewriter::rewriteStatements(const std::vector<StatementIndex>& statements, bool& changed)
+{
+    std::vector<StatementIndex> result;
+    result.reserve(statements.size());
+    for (auto stmt : statements)
+    {
+        result.push_back(rewrite(stmt));
+        changed |= !(result.back() == stmt);
+    }
+    return result;
+}
+
+ExpressionIndex ASTRewriter::ExprRewriteVisitor::operator()(Index<Binary> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    auto left = r.rewrite(node.left);
+    auto right = r.rewrite(node.right);
+    if (left == node.left && right == node.right)
+        return idx;
+    return r.ctxt.makeBinary(left, node.op, right);
+}
+
+ExpressionIndex ASTRewriter::ExprRewriteVisitor::operator()(Index<Assign> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    auto value = r.rewrite(node.value);
+    if (value == node.value)
+        return idx;
+    return r.ctxt.makeAssign(node.name, value);
+}
+
+ExpressionIndex ASTRewriter::ExprRewriteVisitor::operator()(Index<Unary> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    auto subExpr = r.rewrite(node.subExpr);
+    if (subExpr == node.subExpr)
+        return idx;
+    return r.ctxt.makeUnary(node.op, subExpr);
+}
+
+ExpressionIndex ASTRewriter::ExprRewriteVisitor::operator()(Index<Grouping> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    auto subExpr = r.rewrite(node.subExpr);
+    if (subExpr == node.subExpr)
+        return idx;
+    return r.ctxt.makeGrouping(node.begin, subExpr, node.end);
+}
+
+ExpressionIndex ASTRewriter::ExprRewriteVisitor::operator()(Index<Call> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    auto callee = r.rewrite(node.callee);
+    bool changed = !(callee == node.callee);
+    std::vector<ExpressionIndex> args;
+    args.reserve(node.args.size());
+    for (auto arg : node.args)
+    {
+        args.push_back(r.rewrite(arg));
+        changed |= !(args.back() == arg);
+    }
+    if (!changed)
+        return idx;
+    return r.ctxt.makeCall(callee, node.open, std::move(args), node.close);
+}
+
+StatementIndex ASTRewriter::StmtRewriteVisitor::operator()(Index<PrintStatement> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    auto subExpr = r.rewrite(node.subExpr);
+    if (subExpr == node.subExpr)
+        return idx;
+    return r.ctxt.makePrint(subExpr);
+}
+
+StatementIndex ASTRewriter::StmtRewriteVisitor::operator()(Index<ExprStatement> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    auto subExpr = r.rewrite(node.subExpr);
+    if (subExpr == node.subExpr)
+        return idx;
+    return r.ctxt.makeExprStmt(subExpr);
+}
+
+StatementIndex ASTRewriter::StmtRewriteVisitor::operator()(Index<VarDecl> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    r.declare(node.name);
+    std::optional<ExpressionIndex> init;
+    if (node.init)
+        init = r.rewrite(*node.init);
+    r.define(node.name);
+    if (init == node.init)
+        return idx;
+    return r.ctxt.makeVarDecl(node.name, init, node.isConst);
+}
+
+StatementIndex ASTRewriter::StmtRewriteVisitor::operator()(Index<FunDecl> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    r.declare(node.name);
+    r.define(node.name);
+
+    r.beginScope();
+    for (auto param : node.params)
+    {
+        r.declare(param);
+        r.define(param);
+    }
+    bool changed = false;
+    auto body = r.rewriteStatements(node.body, changed);
+    r.endScope();
+
+    if (!changed)
+        return idx;
+    return r.ctxt.makeFunDecl(node.name, std::move(node.params), std::move(body));
+}
+
+StatementIndex ASTRewriter::StmtRewriteVisitor::operator()(Index<Return> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    if (!node.value)
+        return idx;
+    auto value = r.rewrite(*node.value);
+    if (value == *node.value)
+        return idx;
+    return r.ctxt.makeReturn(node.keyword, value);
+}
+
+StatementIndex ASTRewriter::StmtRewriteVisitor::operator()(Index<Block> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    r.beginScope();
+    bool changed = false;
+    auto statements = r.rewriteStatements(node.statements, changed);
+    r.endScope();
+    if (!changed)
+        return idx;
+    return r.ctxt.makeBlock(std::move(statements));
+}
+
+StatementIndex ASTRewriter::StmtRewriteVisitor::operator()(Index<IfStatement> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    auto condition = r.rewrite(node.condition);
+    auto thenBranch = r.rewrite(node.thenBranch);
+    std::optional<StatementIndex> elseBranch;
+    if (node.elseBranch)
+        elseBranch = r.rewrite(*node.elseBranch);
+    if (condition == node.condition && thenBranch == node.thenBranch && elseBranch == node.elseBranch)
+        return idx;
+    return r.ctxt.makeIf(condition, thenBranch, elseBranch);
+}
+
+StatementIndex ASTRewriter::StmtRewriteVisitor::operator()(Index<WhileStatement> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    auto condition = r.rewrite(node.condition);
+    auto body = r.rewrite(node.body);
+    if (condition == node.condition && body == node.body)
+        return idx;
+    return r.ctxt.makeWhile(condition, body);
+}
+
+StatementIndex ASTRewriter::StmtRewriteVisitor::operator()(Index<Unit> idx) const
+{
+    auto node = copyOf(r.ctxt, idx);
+    bool changed = false;
+    auto statements = r.rewriteStatements(node.statements, changed);
+    if (!changed)
+        return idx;
+    return r.ctxt.makeUnit(std::move(statements));
+}
+
+namespace
+{
+// Upper bound on the number of nodes in an inlined expression.
+constexpr unsigned maxInlineSize = 24;
+
+struct InlineCandidate
+{
+    std::vector<Index<Token>> params;
+    ExpressionIndex body;
+    unsigned declaredAt; // Position among the top level statements.
+    bool hasCalls = false;
+    std::vector<std::string> freeNames;
+};
+
+class Inliner : public ASTRewriter
+{
+public:
+    using ASTRewriter::ASTRewriter;
+
+    Index<Unit> run(Index<Unit> unit);
+
+    ExpressionIndex rewrite(ExpressionIndex expr) override;
+    using ASTRewriter::rewrite;
+
+private:
+    void collectCandidates(Index<Unit> unit);
+    std::optional<InlineCandidate> asCandidate(const FunDecl& decl, unsigned position) const;
+    bool isInlinableBody(ExpressionIndex expr, const std::string& self,
+                         InlineCandidate& candidate, unsigned& size) const;
+
+    bool isTrivialArgument(ExpressionIndex arg, bool allowVariables) const;
+    ExpressionIndex clone(ExpressionIndex expr,
+                          const std::unordered_map<std::string, ExpressionIndex>& substitutions);
+
+    std::unordered_map<std::string, InlineCandidate> candidates;
+    std::unordered_set<std::string> assignedNames;
+    std::unordered_set<std::string> declaredGlobals;
+    unsigned currentTopLevel = 0;
+};
+
+Index<Unit> Inliner::run(Index<Unit> unit)
+{
+    collectCandidates(unit);
+    if (candidates.empty())
+        return unit;
+
+    auto node = copyOf(ctxt, unit);
+    std::vector<StatementIndex> statements;
+    bool changed = false;
+    for (currentTopLevel = 0; currentTopLevel < node.statements.size(); ++currentTopLevel)
+    {
+        auto stmt = node.statements[currentTopLevel];
+        statements.push_back(rewrite(stmt));
+        changed |= !(statements.back() == stmt);
+
+        // Names declared by earlier top level statements are
+        // guaranteed to be defined when later ones run.
+        std::visit(Overloaded{
+            [this](Index<VarDecl> v) { declaredGlobals.insert(nameOf(copyOf(ctxt, v).name)); },
+            [this](Index<FunDecl> f) { declaredGlobals.insert(nameOf(copyOf(ctxt, f).name)); },
+            [](auto) {}
+        }, stmt);
+    }
+
+    if (!changed)
+        return unit;
+    return ctxt.makeUnit(std::move(statements));
+}
+
+void Inliner::collectCandidates(Index<Unit> unitIdx)
+{
+    assignedNames = collectAssignedNames(ctxt, unitIdx);
+
+    auto unit = copyOf(ctxt, unitIdx);
+    std::unordered_map<std::string, unsigned> declarationCount;
+    for (unsigned i = 0; i < unit.statements.size(); ++i)
+    {
+        auto stmt = unit.statements[i];
+        if (const auto* var = std::get_if<Index<VarDecl>>(&stmt))
+            ++declarationCount[nameOf(copyOf(ctxt, *var).name)];
+
+        if (const auto* fun = std::get_if<Index<FunDecl>>(&stmt))
+        {
+            auto decl = copyOf(ctxt, *fun);
+            const auto& name = nameOf(decl.name);
+            ++declarationCount[name];
+            if (auto candidate = asCandidate(decl, i))
+                candidates.insert_or_assign(name, std::move(*candidate));
+        }
+    }
+
+    // Functions that might be rebound are not safe to inline.
+    std::erase_if(candidates, [&](const auto& entry) {
+        return declarationCount[entry.first] != 1 || assignedNames.contains(entry.first);
+    });
+}
+
+std::optional<InlineCandidate> Inliner::asCandidate(const FunDecl& decl, unsigned position) const
+{
+    if (decl.body.size() != 1)
+        return std::nullopt;
+
+    const auto* ret = std::get_if<Index<Return>>(&decl.body.front());
+    if (!ret)
+        return std::nullopt;
+
+    auto retNode = copyOf(ctxt, *ret);
+    if (!retNode.value)
+        return std::nullopt;
+
+    // Leave reporting duplicate parameters to the resolver.
+    std::unordered_set<std::string> paramNames;
+    for (auto param : decl.params)
+    {
+        if (!paramNames.insert(nameOf(param)).second)
+            return std::nullopt;
+    }
+
+    InlineCandidate candidate{decl.params, *retNode.value, position, false, {}};
+    unsigned size = 0;
+    if (!isInlinableBody(*retNode.value, nameOf(decl.name), candidate, size))
+        return std::nullopt;
+
+    return candidate;
+}
+
+bool Inliner::isInlinableBody(ExpressionIndex expr, const std::string& self,
+                              InlineCandidate& candidate, unsigned& size) const
+{
+    if (++size > maxInlineSize)
+        return false;
+
+    return std::visit(Overloaded{
+        [&](Index<Literal>) { return true; },
+        [&](Index<DeclRef> r) {
+            const auto& name = nameOf(copyOf(ctxt, r).name);
+            if (name == self)
+                return false;
+
+            bool isParam = std::ranges::any_of(candidate.params, [&](Index<Token> p) {
+                return nameOf(p) == name;
+            });
+            if (!isParam)
+                candidate.freeNames.push_back(name);
+            return true;
+        },
+        [&](Index<Grouping> g) {
+            return isInlinableBody(copyOf(ctxt, g).subExpr, self, candidate, size);
+        },
+        [&](Index<Unary> u) {
+            return isInlinableBody(copyOf(ctxt, u).subExpr, self, candidate, size);
+        },
+        [&](Index<Binary> b) {
+            auto node = copyOf(ctxt, b);
+            return isInlinableBody(node.left, self, candidate, size) &&
+                   isInlinableBody(node.right, self, candidate, size);
+        },
+        [&](Index<Call> c) {
+            candidate.hasCalls = true;
+            auto node = copyOf(ctxt, c);
+            if (!isInlinableBody(node.callee, self, candidate, size))
+                return false;
+            return std::ranges::all_of(node.args, [&](ExpressionIndex arg) {
+                return isInlinableBody(arg, self, candidate, size);
+            });
+        },
+        [&](Index<Assign>) { return false; }
+    }, expr);
+}
+
+// Evaluating a trivial argument has no side effects and cannot fail,
+// so it is safe to evaluate it any number of times, in any order.
+bool Inliner::isTrivialArgument(ExpressionIndex arg, bool allowVariables) const
+{
+    return std::visit(Overloaded{
+        [](Index<Literal>) { return true; },
+        [&](Index<Grouping> g) { return isTrivialArgument(copyOf(ctxt, g).subExpr, allowVariables); },
+        [&](Index<DeclRef> r) {
+            if (!allowVariables)
+                return false;
+            const auto& name = nameOf(copyOf(ctxt, r).name);
+            if (isLocal(name))
+                return isDefinedLocal(name);
+            return declaredGlobals.contains(name);
+        },
+        [](auto) { return false; }
+    }, arg);
+}
+
+ExpressionIndex Inliner::clone(ExpressionIndex expr,
+                               const std::unordered_map<std::string, ExpressionIndex>& substitutions)
+{
+    return std::visit(Overloaded{
+        [&](Index<Literal> l) -> ExpressionIndex {
+            return ctxt.makeLiteral(copyOf(ctxt, l).value);
+        },
+        [&](Index<DeclRef> r) -> ExpressionIndex {
+            auto name = copyOf(ctxt, r).name;
+            if (auto it = substitutions.find(nameOf(name)); it != substitutions.end())
+                return clone(it->second, {});
+            return ctxt.makeDeclRef(name);
+        },
+        [&](Index<Grouping> g) -> ExpressionIndex {
+            auto node = copyOf(ctxt, g);
+            auto subExpr = clone(node.subExpr, substitutions);
+            return ctxt.makeGrouping(node.begin, subExpr, node.end);
+        },
+        [&](Index<Unary> u) -> ExpressionIndex {
+            auto node = copyOf(ctxt, u);
+            auto subExpr = clone(node.subExpr, substitutions);
+            return ctxt.makeUnary(node.op, subExpr);
+        },
+        [&](Index<Binary> b) -> ExpressionIndex {
+            auto node = copyOf(ctxt, b);
+            auto left = clone(node.left, substitutions);
+            auto right = clone(node.right, substitutions);
+            return ctxt.makeBinary(left, node.op, right);
+        },
+        [&](Index<Call> c) -> ExpressionIndex {
+            auto node = copyOf(ctxt, c);
+            auto callee = clone(node.callee, substitutions);
+            std::vector<ExpressionIndex> args;
+            for (auto arg : node.args)
+                args.push_back(clone(arg, substitutions));
+            return ctxt.makeCall(callee, node.open, std::move(args), node.close);
+        },
+        [&](Index<Assign> a) -> ExpressionIndex {
+            auto node = copyOf(ctxt, a);
+            auto value = clone(node.value, substitutions);
+            return ctxt.makeAssign(node.name, value);
+        }
+    }, expr);
+}
+
+ExpressionIndex Inliner::rewrite(ExpressionIndex expr)
+{
+    expr = rewriteChildren(expr);
+
+    const auto* callIdx = std::get_if<Index<Call>>(&expr);
+    if (!callIdx)
+        return expr;
+
+    auto call = copyOf(ctxt, *callIdx);
+    const auto* calleeIdx = std::get_if<Index<DeclRef>>(&call.callee);
+    if (!calleeIdx)
+        return expr;
+
+    const auto& name = nameOf(copyOf(ctxt, *calleeIdx).name);
+    auto it = candidates.find(name);
+    if (it == candidates.end() || isLocal(name))
+        return expr;
+
+    // The callee must be defined by the time the call site runs.
+    const auto& candidate = it->second;
+    if (candidate.declaredAt >= currentTopLevel)
+        return expr;
+
+    if (candidate.params.size() != call.args.size())
+        return expr;
+
+    // Calls in the body could observe or modify the variables passed
+    // as arguments, so only literals are substituted in that case.
+    bool allowVariables = !candidate.hasCalls;
+    if (!std::ranges::all_of(call.args, [&](ExpressionIndex arg) { return isTrivialArgument(arg, allowVariables); }))
+        return expr;
+
+    // Globals referenced by the body must not be shadowed at the call site.
+    if (std::ranges::any_of(candidate.freeNames, [this](const std::string& n) { return isLocal(n); }))
+        return expr;
+
+    std::unordered_map<std::string, ExpressionIndex> substitutions;
+    for (unsigned i = 0; i < call.args.size(); ++i)
+        substitutions.insert_or_assign(nameOf(candidate.params[i]), call.args[i]);
+
+    return clone(candidate.body, substitutions);
+}
+} // anonymous namespace
+
+Index<Unit> inlineCalls(ASTContext& ctxt, Index<Unit> unit)
+{
+    Inliner inliner(ctxt);
+    return inliner.run(unit);
+}
+
+namespace
+{
+struct LoopSummary
+{
+    std::unordered_set<std::string> referenced;
+    std::unordered_set<std::string> declared;
+    bool hasCalls = false;
+};
+
+class LoopSummarizer
+{
+public:
+    LoopSummarizer(const ASTContext& ctxt, LoopSummary& summary) noexcept
+        : ctxt(ctxt), summary(summary) {}
+
+    void visit(ExpressionIndex expr)
+    {
+        std::visit(Overloaded{
+            [this](const Binary* b) { visit(b->left); visit(b->right); },
+            [this](const Assign* a) { visit(a->value); },
+            [this](const Unary* u) { visit(u->subExpr); },
+            [](const Literal*) {},
+            [this](const Grouping* g) { visit(g->subExpr); },
+            [this](const DeclRef* r) { summary.referenced.insert(nameOf(r->name)); },
+            [this](const Call* c) {
+                summary.hasCalls = true;
+                visit(c->callee);
+                for (auto arg : c->args)
+                    visit(arg);
+            }
+        }, ctxt.getNode(expr));
+    }
+
+    void visit(StatementIndex stmt)
+    {
+        std::visit(Overloaded{
+            [this](const PrintStatement* p) { visit(p->subExpr); },
+            [this](const ExprStatement* e) { visit(e->subExpr); },
+            [this](const VarDecl* v) {
+                summary.declared.insert(nameOf(v->name));
+                if (v->init)
+                    visit(*v->init);
+            },
+            [this](const FunDecl* f) {
+                summary.declared.insert(nameOf(f->name));
+                for (auto param : f->params)
+                    summary.declared.insert(nameOf(param));
+                for (auto s : f->body)
+                    visit(s);
+            },
+            [this](const Return* r) {
+                if (r->value)
+                    visit(*r->value);
+            },
+            [this](const Block* b) {
+                for (auto s : b->statements)
+                    visit(s);
+            },
+            [this](const IfStatement* i) {
+                visit(i->condition);
+                visit(i->thenBranch);
+                if (i->elseBranch)
+                    visit(*i->elseBranch);
+            },
+            [this](const WhileStatement* w) { visit(w->condition); visit(w->body); },
+            [this](const Unit* u) {
+                for (auto s : u->statements)
+                    visit(s);
+            }
+        }, ctxt.getNode(stmt));
+    }
+
+private:
+    const std::string& nameOf(Index<Token> tok) const noexcept
+    {
+        return std::get<std::string>(ctxt.getToken(tok).value);
+    }
+
+    const ASTContext& ctxt;
+    LoopSummary& summary;
+};
+
+// Names assigned anywhere in a function body. Calls might change
+// these variables behind the back of a loop.
+class FunctionWriteCollector
+{
+public:
+    explicit FunctionWriteCollector(const ASTContext& ctxt) noexcept : ctxt(ctxt) {}
+
+    std::unordered_set<std::string> collect(StatementIndex root)
+    {
+        visit(root, false);
+        return std::move(names);
+    }
+
+private:
+    void visit(StatementIndex stmt, bool inFunction)
+    {
+        if (inFunction)
+            names.merge(collectAssignedNames(ctxt, stmt));
+
+        std::visit(Overloaded{
+            [&](const FunDecl* f) {
+                for (auto s : f->body)
+                    visit(s, true);
+            },
+            [&](const Block* b) {
+                for (auto s : b->statements)
+                    visit(s, inFunction);
+            },
+            [&](const IfStatement* i) {
+                visit(i->thenBranch, inFunction);
+                if (i->elseBranch)
+                    visit(*i->elseBranch, inFunction);
+            },
+            [&](const WhileStatement* w) { visit(w->body, inFunction); },
+            [&](const Unit* u) {
+                for (auto s : u->statements)
+                    visit(s, inFunction);
+            },
+            [](const auto*) {}
+        }, ctxt.getNode(stmt));
+    }
+
+    const ASTContext& ctxt;
+    std::unordered_set<std::string> names;
+};
+
+struct HoistedExpr
+{
+    Index<Token> temporary;
+    std::optional<ExpressionIndex> value; // Computed on first use when missing.
+};
+
+// Replaces the maximal invariant sub-expressions of a single loop.
+// Expressions that cannot fail are computed before the loop. The
+// arithmetic that might fail is computed where it first runs, by
+// `$t or ($t = e)`, so the error is reported at the same point. The
+// results of arithmetic are numbers or strings, never falsy.
+class InvariantHoister : public ASTRewriter
+{
+public:
+    InvariantHoister(ASTContext& ctxt, const TypeFacts& facts,
+                     std::unordered_set<std::string> invariantNames,
+                     std::unordered_set<std::string> definedNames,
+                     std::unordered_set<unsigned>& guards, unsigned& tempCounter) noexcept
+        : ASTRewriter(ctxt), facts(facts), invariantNames(std::move(invariantNames)),
+          definedNames(std::move(definedNames)), guards(guards), tempCounter(tempCounter) {}
+
+    ExpressionIndex rewrite(ExpressionIndex expr) override;
+    StatementIndex rewrite(StatementIndex stmt) override;
+
+    std::vector<HoistedExpr> hoisted;
+
+private:
+    bool isInvariant(ExpressionIndex expr) const;
+    bool cannotFail(ExpressionIndex expr) const;
+    bool isArithmetic(ExpressionIndex expr) const;
+
+    const TypeFacts& facts;
+    std::unordered_set<std::string> invariantNames;
+    std::unordered_set<std::string> definedNames;
+    std::unordered_set<unsigned>& guards; // The `or` nodes computing temporaries.
+    unsigned& tempCounter;
+};
+
+// Invariant expressions have no side effects and evaluate to the
+// same value in every iteration.
+bool InvariantHoister::isInvariant(ExpressionIndex expr) const
+{
+    return std::visit(Overloaded{
+        [](Index<Literal>) { return true; },
+        [&](Index<DeclRef> r) { return invariantNames.contains(nameOf(copyOf(ctxt, r).name)); },
+        [&](Index<Grouping> g) { return isInvariant(copyOf(ctxt, g).subExpr); },
+        [&](Index<Unary> u) { return isInvariant(copyOf(ctxt, u).subExpr); },
+        [&](Index<Binary> b) {
+            auto node = copyOf(ctxt, b);
+            return isInvariant(node.left) && isInvariant(node.right);
+        },
+        [](auto) { return false; }
+    }, expr);
+}
+
+// Expressions reading initialized locals with operators applied to
+// operands of the right types cannot fail.
+bool InvariantHoister::cannotFail(ExpressionIndex expr) const
+{
+    return std::visit(Overloaded{
+        [](Index<Literal>) { return true; },
+        [&](Index<DeclRef> r) { return definedNames.contains(nameOf(copyOf(ctxt, r).name)); },
+        [&](Index<Grouping> g) { return cannotFail(copyOf(ctxt, g).subExpr); },
+        [&](Index<Unary> u) {
+            auto node = copyOf(ctxt, u);
+            if (!cannotFail(node.subExpr))
+                return false;
+            return node.kind == UnaryOp::Not || facts.operandsOf(u) == StaticType::Number;
+        },
+        [&](Index<Binary> b) {
+            auto node = copyOf(ctxt, b);
+            if (!cannotFail(node.left) || !cannotFail(node.right))
+                return false;
+            auto operands = facts.operandsOf(b);
+            switch (node.kind)
+            {
+            case BinaryOp::And:
+            case BinaryOp::Or:
+            case BinaryOp::Equal:
+                return true;
+            case BinaryOp::Add:
+                return operands == StaticType::Number || operands == StaticType::String;
+            case BinaryOp::Subtract:
+            case BinaryOp::Multiply:
+            case BinaryOp::Divide:
+            case BinaryOp::Less:
+            case BinaryOp::LessEqual:
+            case BinaryOp::Greater:
+            case BinaryOp::GreaterEqual:
+                return operands == StaticType::Number;
+            default:
+                return false;
+            }
+        },
+        [](auto) { return false; }
+    }, expr);
+}
+
+bool InvariantHoister::isArithmetic(ExpressionIndex expr) const
+{
+    if (const auto* u = std::get_if<Index<Unary>>(&expr))
+        return copyOf(ctxt, *u).kind == UnaryOp::Negate;
+    if (const auto* b = std::get_if<Index<Binary>>(&expr))
+    {
+        auto kind = copyOf(ctxt, *b).kind;
+        return kind == BinaryOp::Add || kind == BinaryOp::Subtract ||
+               kind == BinaryOp::Multiply || kind == BinaryOp::Divide;
+    }
+    return false;
+}
+
+ExpressionIndex InvariantHoister::rewrite(ExpressionIndex expr)
+{
+    // Hoisted by an enclosing loop already.
+    if (const auto* b = std::get_if<Index<Binary>>(&expr); b && guards.contains(b->id))
+        return expr;
+
+    // Variables and literals are as cheap as the temporary would be.
+    bool hasOperator = std::holds_alternative<Index<Binary>>(expr) ||
+                       std::holds_alternative<Index<Unary>>(expr);
+    if (!hasOperator || !isInvariant(expr))
+        return rewriteChildren(expr);
+
+    bool hoistBeforeLoop = cannotFail(expr);
+    if (!hoistBeforeLoop && !isArithmetic(expr))
+        return rewriteChildren(expr);
+
+    // Identifiers cannot contain '$', so the name is not taken.
+    auto temporary = ctxt.makeSyntheticToken(Token(IDENTIFIER, -1, fmt::format("$licm{}", tempCounter++)));
+    if (hoistBeforeLoop)
+    {
+        hoisted.push_back({temporary, expr});
+        return ctxt.makeDeclRef(temporary);
+    }
+
+    hoisted.push_back({temporary, std::nullopt});
+    auto orToken = ctxt.makeSyntheticToken(Token(OR, -1));
+    auto guard = ctxt.makeBinary(ctxt.makeDeclRef(temporary), orToken, ctxt.makeAssign(temporary, expr));
+    guards.insert(guard.id);
+    return guard;
+}
+
+StatementIndex InvariantHoister::rewrite(StatementIndex stmt)
+{
+    // The bodies of functions do not run as part of the loop.
+    if (std::holds_alternative<Index<FunDecl>>(stmt))
+        return stmt;
+    return rewriteChildren(stmt);
+}
+
+class LoopInvariantMotion : public ASTRewriter
+{
+public:
+    LoopInvariantMotion(ASTContext& ctxt, TypeFacts facts,
+                        std::unordered_set<std::string> writtenByFunctions) noexcept
+        : ASTRewriter(ctxt), facts(std::move(facts)), writtenByFunctions(std::move(writtenByFunctions)) {}
+
+    StatementIndex rewrite(StatementIndex stmt) override;
+    using ASTRewriter::rewrite;
+
+private:
+    StatementIndex hoistFrom(Index<WhileStatement> loop);
+
+    TypeFacts facts;
+    std::unordered_set<std::string> writtenByFunctions;
+    std::unordered_set<unsigned> guards;
+    unsigned tempCounter = 0;
+};
+
+StatementIndex LoopInvariantMotion::rewrite(StatementIndex stmt)
+{
+    // Outer loops first, so expressions invariant in nested loops are
+    // moved out of all of them at once.
+    if (const auto* loop = std::get_if<Index<WhileStatement>>(&stmt))
+        return hoistFrom(*loop);
+    return rewriteChildren(stmt);
+}
+
+StatementIndex LoopInvariantMotion::hoistFrom(Index<WhileStatement> loop)
+{
+    LoopSummary summary;
+    LoopSummarizer(ctxt, summary).visit(StatementIndex{loop});
+    auto assigned = collectAssignedNames(ctxt, loop);
+
+    std::unordered_set<std::string> invariantNames;
+    std::unordered_set<std::string> definedNames;
+    for (const auto& name : summary.referenced)
+    {
+        if (assigned.contains(name) || summary.declared.contains(name))
+            continue;
+        if (summary.hasCalls && writtenByFunctions.contains(name))
+            continue;
+        invariantNames.insert(name);
+        if (isDefinedLocal(name))
+            definedNames.insert(name);
+    }
+    if (invariantNames.empty())
+        return rewriteChildren(loop);
+
+    auto node = copyOf(ctxt, loop);
+    InvariantHoister hoister(ctxt, facts, std::move(invariantNames), std::move(definedNames),
+                             guards, tempCounter);
+    auto condition = hoister.rewrite(node.condition);
+    auto body = hoister.rewrite(node.body);
+    if (hoister.hoisted.empty())
+        return rewriteChildren(loop);
+
+    std::vector<StatementIndex> statements;
+    for (auto [temporary, value] : hoister.hoisted)
+        statements.push_back(ctxt.makeVarDecl(temporary, value));
+    // Nested loops might have expressions invariant only in them.
+    statements.push_back(rewriteChildren(ctxt.makeWhile(condition, body)));
+    return ctxt.makeBlock(std::move(statements));
+}
+} // anonymous namespace
+
+Index<Unit> hoistLoopInvariants(ASTContext& ctxt, Index<Unit> unit)
+{
+    // Refining the operands would rely on operations in the loop that
+    // might not run before the hoisted expressions.
+    auto facts = TypeInference(ctxt, false).inferTypes(unit);
+    auto writtenByFunctions = FunctionWriteCollector(ctxt).collect(unit);
+    LoopInvariantMotion motion(ctxt, std::move(facts), std::move(writtenByFunctions));
+    auto result = motion.rewrite(StatementIndex{unit});
+    return std::get<Index<Unit>>(result);
+}
+
+namespace
+{
+// The token of a literal, possibly in parentheses.
+std::optional<Index<Token>> literalOf(const ASTContext& ctxt, ExpressionIndex expr)
+{
+    if (const auto* group = std::get_if<Index<Grouping>>(&expr))
+        return literalOf(ctxt, copyOf(ctxt, *group).subExpr);
+    if (const auto* literal = std::get_if<Index<Literal>>(&expr))
+        return copyOf(ctxt, *literal).value;
+    return std::nullopt;
+}
+
+class ConstantPropagator : public ASTRewriter
+{
+public:
+    ConstantPropagator(ASTContext& ctxt, bool pruneBranches) noexcept
+        : ASTRewriter(ctxt), pruneBranches(pruneBranches) {}
+
+    ExpressionIndex rewrite(ExpressionIndex expr) override;
+    StatementIndex rewrite(StatementIndex stmt) override;
+
+    // Treat unshadowed references to a global as the given literal.
+    void assumeConstant(const std::string& name, Index<Token> literal)
+    {
+        globalConstants.insert_or_assign(name, literal);
+    }
+
+private:
+    std::optional<Index<Token>> asLiteral(ExpressionIndex expr) const { return literalOf(ctxt, expr); }
+    StatementIndex prune(StatementIndex stmt);
+    std::optional<Token> fold(const Unary& node) const;
+    std::optional<Token> fold(const Binary& node) const;
+
+    // The literal values of local constants by their declaration,
+    // and of the global constants by their names.
+    std::unordered_map<Index<Token>, Index<Token>> localConstants;
+    std::unordered_map<std::string, Index<Token>> globalConstants;
+    bool pruneBranches;
+};
+
+std::optional<Token> ConstantPropagator::fold(const Unary& node) const
+{
+    auto operand = asLiteral(node.subExpr);
+    if (!operand)
+        return std::nullopt;
+
+    const auto& op = ctxt.getToken(node.op);
+    const auto& value = ctxt.getToken(*operand);
+    if (op.type == MINUS && value.type == NUMBER)
+        return Token(NUMBER, op.line, -std::get<double>(value.value));
+    if (op.type == BANG)
+    {
+        bool isTruthy = value.type != FALSE && value.type != NIL;
+        return Token(isTruthy ? FALSE : TRUE, op.line);
+    }
+    return std::nullopt;
+}
+
+std::optional<Token> ConstantPropagator::fold(const Binary& node) const
+{
+    auto lhs = asLiteral(node.left);
+    auto rhs = asLiteral(node.right);
+    if (!lhs || !rhs)
+        return std::nullopt;
+
+    const auto& op = ctxt.getToken(node.op);
+    const auto& left = ctxt.getToken(*lhs);
+    const auto& right = ctxt.getToken(*rhs);
+    auto boolean = [&](bool value) { return Token(value ? TRUE : FALSE, op.line); };
+    if (op.type == EQUAL_EQUAL)
+    {
+        // Values of different types are never equal.
+        if (left.type != right.type)
+            return boolean(false);
+        if (left.type == NUMBER)
+            return boolean(std::get<double>(left.value) == std::get<double>(right.value));
+        if (left.type == STRING)
+            return boolean(left.value == right.value);
+        return boolean(true);
+    }
+
+    if (op.type == PLUS && left.type == STRING && right.type == STRING)
+        return Token(STRING, op.line, std::get<std::string>(left.value) + std::get<std::string>(right.value));
+
+    if (left.type != NUMBER || right.type != NUMBER)
+        return std::nullopt;
+
+    double l = std::get<double>(left.value);
+    double r = std::get<double>(right.value);
+    switch (op.type)
+    {
+    case PLUS: return Token(NUMBER, op.line, l + r);
+    case MINUS: return Token(NUMBER, op.line, l - r);
+    case STAR: return Token(NUMBER, op.line, l * r);
+    case SLASH: return Token(NUMBER, op.line, l / r);
+    case LESS: return boolean(l < r);
+    case LESS_EQUAL: return boolean(l <= r);
+    case GREATER: return boolean(l > r);
+    case GREATER_EQUAL: return boolean(l >= r);
+    default: return std::nullopt;
+    }
+}
+
+ExpressionIndex ConstantPropagator::rewrite(ExpressionIndex expr)
+{
+    expr = rewriteChildren(expr);
+
+    return std::visit(Overloaded{
+        [&](Index<DeclRef> r) -> ExpressionIndex {
+            auto name = copyOf(ctxt, r).name;
+            if (auto decl = localDeclaration(nameOf(name)))
+            {
+                if (auto it = localConstants.find(*decl); it != localConstants.end())
+                    return ctxt.makeLiteral(it->second);
+                return r;
+            }
+            if (auto it = globalConstants.find(nameOf(name)); it != globalConstants.end())
+                return ctxt.makeLiteral(it->second);
+            return r;
+        },
+        [&](Index<Unary> u) -> ExpressionIndex {
+            if (auto folded = fold(copyOf(ctxt, u)))
+                return ctxt.makeLiteral(ctxt.makeSyntheticToken(*folded));
+            return u;
+        },
+        [&](Index<Binary> b) -> ExpressionIndex {
+            if (auto folded = fold(copyOf(ctxt, b)))
+                return ctxt.makeLiteral(ctxt.makeSyntheticToken(*folded));
+            return b;
+        },
+        [](auto other) -> ExpressionIndex { return other; }
+    }, expr);
+}
+
+// Removes the branches that cannot run. Branches are statements,
+// not declarations, so they can replace the conditional directly.
+StatementIndex ConstantPropagator::prune(StatementIndex stmt)
+{
+    if (!pruneBranches)
+        return stmt;
+
+    auto isTruthy = [this](Index<Token> literal) {
+        auto type = ctxt.getToken(literal).type;
+        return type != FALSE && type != NIL;
+    };
+
+    if (const auto* ifStmt = std::get_if<Index<IfStatement>>(&stmt))
+    {
+        auto node = copyOf(ctxt, *ifStmt);
+        auto condition = asLiteral(node.condition);
+        if (!condition)
+            return stmt;
+        if (isTruthy(*condition))
+            return node.thenBranch;
+        if (node.elseBranch)
+            return *node.elseBranch;
+        return ctxt.makeBlock({});
+    }
+
+    if (const auto* loop = std::get_if<Index<WhileStatement>>(&stmt))
+    {
+        auto condition = asLiteral(copyOf(ctxt, *loop).condition);
+        if (condition && !isTruthy(*condition))
+            return ctxt.makeBlock({});
+    }
+    return stmt;
+}
+
+StatementIndex ConstantPropagator::rewrite(StatementIndex stmt)
+{
+    bool isGlobal = isGlobalScope();
+    stmt = prune(rewriteChildren(stmt));
+
+    const auto* var = std::get_if<Index<VarDecl>>(&stmt);
+    if (!var)
+        return stmt;
+
+    auto node = copyOf(ctxt, *var);
+    if (!node.isConst)
+        return stmt;
+
+    // References before the declaration are left alone, they are
+    // either errors or refer to other variables.
+    if (auto literal = asLiteral(*node.init))
+    {
+        if (isGlobal)
+            globalConstants.insert_or_assign(nameOf(node.name), *literal);
+        else
+            localConstants.insert_or_assign(node.name, *literal);
+    }
+    return stmt;
+}
+
+// Deep copy of a subtree, so analyses keyed by the nodes can tell the
+// copy and the original apart.
+class TreeCloner
+{
+public:
+    explicit TreeCloner(ASTContext& ctxt) noexcept : ctxt(ctxt) {}
+
+    ExpressionIndex clone(ExpressionIndex expr)
+    {
+        return std::visit(Overloaded{
+            [&](Index<Binary> b) -> ExpressionIndex {
+                auto node = copyOf(ctxt, b);
+                auto left = clone(node.left);
+                auto right = clone(node.right);
+                return ctxt.makeBinary(left, node.op, right);
+            },
+            [&](Index<Assign> a) -> ExpressionIndex {
+                auto node = copyOf(ctxt, a);
+                auto value = clone(node.value);
+                return ctxt.makeAssign(node.name, value);
+            },
+            [&](Index<Unary> u) -> ExpressionIndex {
+                auto node = copyOf(ctxt, u);
+                auto subExpr = clone(node.subExpr);
+                return ctxt.makeUnary(node.op, subExpr);
+            },
+            [&](Index<Literal> l) -> ExpressionIndex {
+                return ctxt.makeLiteral(copyOf(ctxt, l).value);
+            },
+            [&](Index<Grouping> g) -> ExpressionIndex {
+                auto node = copyOf(ctxt, g);
+                auto subExpr = clone(node.subExpr);
+                return ctxt.makeGrouping(node.begin, subExpr, node.end);
+            },
+            [&](Index<DeclRef> r) -> ExpressionIndex {
+                return ctxt.makeDeclRef(copyOf(ctxt, r).name);
+            },
+            [&](Index<Call> c) -> ExpressionIndex {
+                auto node = copyOf(ctxt, c);
+                auto callee = clone(node.callee);
+                std::vector<ExpressionIndex> args;
+                for (auto arg : node.args)
+                    args.push_back(clone(arg));
+                return ctxt.makeCall(callee, node.open, std::move(args), node.close);
+            }
+        }, expr);
+    }
+
+    StatementIndex clone(StatementIndex stmt)
+    {
+        return std::visit(Overloaded{
+            [&](Index<PrintStatement> p) -> StatementIndex {
+                auto subExpr = clone(copyOf(ctxt, p).subExpr);
+                return ctxt.makePrint(subExpr);
+            },
+            [&](Index<ExprStatement> e) -> StatementIndex {
+                auto subExpr = clone(copyOf(ctxt, e).subExpr);
+                return ctxt.makeExprStmt(subExpr);
+            },
+            [&](Index<VarDecl> v) -> StatementIndex {
+                auto node = copyOf(ctxt, v);
+                std::optional<ExpressionIndex> init;
+                if (node.init)
+                    init = clone(*node.init);
+                return ctxt.makeVarDecl(node.name, init, node.isConst);
+            },
+            [&](Index<FunDecl> f) -> StatementIndex {
+                auto node = copyOf(ctxt, f);
+                auto body = clone(node.body);
+                return ctxt.makeFunDecl(node.name, std::move(node.params), std::move(body));
+            },
+            [&](Index<Return> r) -> StatementIndex {
+                auto node = copyOf(ctxt, r);
+                std::optional<ExpressionIndex> value;
+                if (node.value)
+                    value = clone(*node.value);
+                return ctxt.makeReturn(node.keyword, value);
+            },
+            [&](Index<Block> b) -> StatementIndex {
+                auto statements = clone(copyOf(ctxt, b).statements);
+                return ctxt.makeBlock(std::move(statements));
+            },
+            [&](Index<IfStatement> i) -> StatementIndex {
+                auto node = copyOf(ctxt, i);
+                auto condition = clone(node.condition);
+                auto thenBranch = clone(node.thenBranch);
+                std::optional<StatementIndex> elseBranch;
+                if (node.elseBranch)
+                    elseBranch = clone(*node.elseBranch);
+                return ctxt.makeIf(condition, thenBranch, elseBranch);
+            },
+            [&](Index<WhileStatement> w) -> StatementIndex {
+                auto node = copyOf(ctxt, w);
+                auto condition = clone(node.condition);
+                auto body = clone(node.body);
+                return ctxt.makeWhile(condition, body);
+            },
+            [&](Index<Unit> u) -> StatementIndex {
+                auto statements = clone(copyOf(ctxt, u).statements);
+                return ctxt.makeUnit(std::move(statements));
+            }
+        }, stmt);
+    }
+
+    std::vector<StatementIndex> clone(const std::vector<StatementIndex>& statements)
+    {
+        std::vector<StatementIndex> result;
+        result.reserve(statements.size());
+        for (auto stmt : statements)
+            result.push_back(clone(stmt));
+        return result;
+    }
+
+private:
+    ASTContext& ctxt;
+};
+
+} // anonymous namespace
+
+Index<Unit> propagateConstants(ASTContext& ctxt, Index<Unit> unit, bool pruneBranches)
+{
+    ConstantPropagator propagator(ctxt, pruneBranches);
+    return std::get<Index<Unit>>(propagator.rewrite(StatementIndex{unit}));
+}
+
+namespace
+{
+// Upper bound on the number of clones per function.
+constexpr unsigned maxSpecializations = 8;
+
+struct SpecializationCandidate
+{
+    Index<FunDecl> decl;
+    unsigned declaredAt; // Position among the top level statements.
+    std::unordered_set<std::string> assignedNames;
+    unsigned specializations = 0;
+};
+
+class Specializer : public ASTRewriter
+{
+public:
+    Specializer(ASTContext& ctxt, bool pruneBranches) noexcept
+        : ASTRewriter(ctxt), pruneBranches(pruneBranches) {}
+
+    Index<Unit> run(Index<Unit> unit);
+
+    ExpressionIndex rewrite(ExpressionIndex expr) override;
+    using ASTRewriter::rewrite;
+
+private:
+    void collectCandidates(Index<Unit> unit);
+    std::string keyOf(Index<Token> literal) const;
+    std::optional<Index<Token>> specialize(const std::string& name, SpecializationCandidate& candidate,
+                                           const std::vector<std::optional<Index<Token>>>& literals);
+
+    struct PendingClone
+    {
+        std::string original;
+        StatementIndex decl;
+    };
+
+    std::unordered_map<std::string, SpecializationCandidate> candidates;
+    std::unordered_map<std::string, Index<Token>> cache;
+    std::vector<PendingClone> pending;
+    std::unordered_map<std::string, std::vector<StatementIndex>> clonesOf;
+    unsigned currentTopLevel = 0;
+    unsigned cloneCounter = 0;
+    bool pruneBranches;
+};
+
+Index<Unit> Specializer::run(Index<Unit> unitIdx)
+{
+    collectCandidates(unitIdx);
+    if (candidates.empty())
+        return unitIdx;
+
+    auto unit = copyOf(ctxt, unitIdx);
+
+    std::vector<StatementIndex> statements;
+    for (currentTopLevel = 0; currentTopLevel < unit.statements.size(); ++currentTopLevel)
+        statements.push_back(rewrite(unit.statements[currentTopLevel]));
+
+    // Clones can call further specializations. Their calls are valid
+    // wherever the calls of the original function are.
+    while (!pending.empty())
+    {
+        auto clone = pending.back();
+        pending.pop_back();
+        currentTopLevel = candidates.at(clone.original).declaredAt;
+        clonesOf[clone.original].push_back(rewrite(clone.decl));
+    }
+    if (clonesOf.empty())
+        return unitIdx;
+
+    // The clones are defined right after the original, so they are
+    // available whenever the original is.
+    std::vector<StatementIndex> result;
+    for (auto stmt : statements)
+    {
+        result.push_back(stmt);
+        const auto* fun = std::get_if<Index<FunDecl>>(&stmt);
+        if (!fun)
+            continue;
+        auto it = clonesOf.find(nameOf(copyOf(ctxt, *fun).name));
+        if (it == clonesOf.end())
+            continue;
+        result.insert(result.end(), it->second.begin(), it->second.end());
+        clonesOf.erase(it);
+    }
+    return ctxt.makeUnit(std::move(result));
+}
+
+void Specializer::collectCandidates(Index<Unit> unitIdx)
+{
+    auto assignedNames = collectAssignedNames(ctxt, unitIdx);
+
+    auto unit = copyOf(ctxt, unitIdx);
+    std::unordered_map<std::string, unsigned> declarationCount;
+    for (unsigned i = 0; i < unit.statements.size(); ++i)
+    {
+        auto stmt = unit.statements[i];
+        if (const auto* var = std::get_if<Index<VarDecl>>(&stmt))
+            ++declarationCount[nameOf(copyOf(ctxt, *var).name)];
+
+        if (const auto* fun = std::get_if<Index<FunDecl>>(&stmt))
+        {
+            const auto& name = nameOf(copyOf(ctxt, *fun).name);
+            ++declarationCount[name];
+            candidates.insert_or_assign(name, SpecializationCandidate{*fun, i, collectAssignedNames(ctxt, stmt), 0});
+        }
+    }
+
+    // Functions that might be rebound are not safe to redirect.
+    std::erase_if(candidates, [&](const auto& entry) {
+        return declarationCount[entry.first] != 1 || assignedNames.contains(entry.first);
+    });
+}
+
+std::string Specializer::keyOf(Index<Token> literal) const
+{
+    const auto& token = ctxt.getToken(literal);
+    switch (token.type)
+    {
+    case NUMBER:
+        // Zero and negative zero are different arguments.
+        return fmt::format("n{}", std::bit_cast<std::uint64_t>(std::get<double>(token.value)));
+    case STRING:
+    {
+        const auto& value = std::get<std::string>(token.value);
+        return fmt::format("s{}:{}", value.size(), value);
+    }
+    default:
+        return std::string(tokenTypeToSourceName(token.type));
+    }
+}
+
+std::optional<Index<Token>> Specializer::specialize(const std::string& name, SpecializationCandidate& candidate,
+                                                    const std::vector<std::optional<Index<Token>>>& literals)
+{
+    auto decl = copyOf(ctxt, candidate.decl);
+
+    std::string key = name;
+    for (unsigned i = 0; i < literals.size(); ++i)
+    {
+        key += literals[i] ? "," + keyOf(*literals[i]) : ",_";
+        // Assignments would need the parameter as a variable.
+        if (literals[i] && candidate.assignedNames.contains(nameOf(decl.params[i])))
+            return std::nullopt;
+    }
+
+    if (auto it = cache.find(key); it != cache.end())
+        return it->second;
+    if (candidate.specializations == maxSpecializations)
+        return std::nullopt;
+    ++candidate.specializations;
+
+    // Identifiers cannot contain '$', so the name is not taken.
+    auto cloneName = ctxt.makeSyntheticToken(
+        Token(IDENTIFIER, ctxt.getToken(decl.name).line, fmt::format("{}${}", name, ++cloneCounter)));
+    cache.insert_or_assign(key, cloneName);
+
+    ConstantPropagator propagator(ctxt, pruneBranches);
+    std::vector<Index<Token>> params;
+    for (unsigned i = 0; i < literals.size(); ++i)
+    {
+        if (literals[i])
+            propagator.assumeConstant(nameOf(decl.params[i]), *literals[i]);
+        else
+            params.push_back(decl.params[i]);
+    }
+
+    auto body = TreeCloner(ctxt).clone(decl.body);
+    StatementIndex clone = ctxt.makeFunDecl(cloneName, std::move(params), std::move(body));
+    pending.push_back({name, propagator.rewrite(clone)});
+    return cloneName;
+}
+
+ExpressionIndex Specializer::rewrite(ExpressionIndex expr)
+{
+    expr = rewriteChildren(expr);
+
+    const auto* callIdx = std::get_if<Index<Call>>(&expr);
+    if (!callIdx)
+        return expr;
+
+    auto call = copyOf(ctxt, *callIdx);
+    const auto* calleeIdx = std::get_if<Index<DeclRef>>(&call.callee);
+    if (!calleeIdx)
+        return expr;
+
+    // Specializing adds tokens, so the name is copied.
+    std::string name = nameOf(copyOf(ctxt, *calleeIdx).name);
+    auto it = candidates.find(name);
+    if (it == candidates.end() || isLocal(name))
+        return expr;
+
+    // The callee must be defined by the time the call site runs.
+    auto& candidate = it->second;
+    if (candidate.declaredAt > currentTopLevel)
+        return expr;
+
+    auto decl = copyOf(ctxt, candidate.decl);
+    if (decl.params.size() != call.args.size())
+        return expr;
+
+    std::vector<std::optional<Index<Token>>> literals;
+    std::vector<ExpressionIndex> args;
+    for (auto arg : call.args)
+    {
+        literals.push_back(literalOf(ctxt, arg));
+        if (!literals.back())
+            args.push_back(arg);
+    }
+    if (args.size() == call.args.size())
+        return expr;
+
+    // Leave reporting duplicate parameters to the resolver.
+    std::unordered_set<std::string> paramNames;
+    for (auto param : decl.params)
+    {
+        if (!paramNames.insert(nameOf(param)).second)
+            return expr;
+    }
+
+    auto cloneName = specialize(name, candidate, literals);
+    if (!cloneName)
+        return expr;
+
+    // Literal arguments have no side effects, dropping them is fine.
+    auto callee = ctxt.makeDeclRef(*cloneName);
+    return ctxt.makeCall(callee, call.open, std::move(args), call.close);
+}
+} // anonymous namespace
+
+Index<Unit> specializeCalls(ASTContext& ctxt, Index<Unit> unit, bool pruneBranches)
+{
+    Specializer specializer(ctxt, pruneBranches);
+    return specializer.run(unit);
+}
@@ -50,6 +50,8 @@ std::optional<StatementIndex> Parser::declaration()
         result = funDeclaration();
     else if (match(VAR))
         result = varDeclaration();
+    else if (match(CONST))
+        result = constDeclaration();
     else
         result = statement();
 
@@ -113,6 +115,15 @@ std::optional<Index<VarDecl>> Parser::varDeclaration()
     return context.makeVarDecl(name, init);
 }
 
+std::optional<Index<VarDecl>> Parser::constDeclaration()
+{
+    BIND(name, consume(IDENTIFIER, "Expect constant name."));
+    MUST_SUCCEED(consume(EQUAL, "Expect '=' after constant name."));
+    BIND(init, expression());
+    consume(SEMICOLON, "Expect ';' after constant declaration.");
+    return context.makeVarDecl(name, init, true);
+}
+
 std::optional<StatementIndex> Parser::statement()
 {
     if (match(FOR)) return forStatement();
@@ -467,6 +478,7 @@ void Parser::synchronize()
         switch(context.getToken(peek()).type)
         {
             case CLASS:
+            case CONST:
             case FUN:
             case VAR:
             case FOR:
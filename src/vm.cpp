@@ -0,0 +1,450 @@
+#include "include/vm.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <fmt/format.h>
+
+#include <include/eval.h>
+
+// Computed gotos jump to the next handler directly, every handler
+// gets its own indirect branch to predict.
+#if defined(__GNUC__)
+#define SLOX_COMPUTED_GOTO
+#endif
+
+namespace
+{
+
+// Values of different kinds are never added together.
+enum class Kind { Nil, Bool, Number, String, Callable };
+
+Kind kindOf(Value value) noexcept
+{
+    switch (value.getType())
+    {
+        case Value::Type::Undefined:
+        case Value::Type::Nil:
+            return Kind::Nil;
+        case Value::Type::Bool:
+            return Kind::Bool;
+        case Value::Type::Number:
+            return Kind::Number;
+        case Value::Type::Object:
+            break;
+    }
+    return value.isObject(ObjType::String) ? Kind::String : Kind::Callable;
+}
+
+ObjString* asString(Value value) noexcept { return static_cast<ObjString*>(value.asObject()); }
+ObjCell* asCell(Value value) noexcept { return static_cast<ObjCell*>(value.asObject()); }
+
+// Append in place when no other string ends at the end of the buffer.
+// Appending a string to itself would read the buffer while it grows.
+ObjString* concatenate(Heap& heap, const ObjString& lhs, const ObjString& rhs)
+{
+    auto& chars = *lhs.buffer;
+    if (lhs.length == chars.size() && lhs.buffer != rhs.buffer)
+    {
+        chars.append(rhs.view());
+        return heap.make<ObjString>(lhs.buffer);
+    }
+
+    std::string result;
+    result.reserve(lhs.length + rhs.length);
+    result.append(lhs.view());
+    result.append(rhs.view());
+    return heap.make<ObjString>(std::move(result));
+}
+
+Value clockNative(const Value*)
+{
+    return Value::fromNumber(
+        std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+constexpr std::size_t initialStackSize = 256;
+
+// Frames live on the heap, the limit only stops runaway recursion
+// before it exhausts the memory.
+constexpr unsigned defaultMaxCallDepth = 4'000'000;
+
+} // anonymous namespace
+
+VM::VM(const ASTContext& ctxt, const DiagnosticEmitter& diag, unsigned maxCallDepth)
+    : ctxt(ctxt), diag(diag), resolver(ctxt, diag), compiler(ctxt, heap), stack(initialStackSize),
+      maxFrames((maxCallDepth ? maxCallDepth : defaultMaxCallDepth) + 1) // And the script.
+{
+}
+
+bool VM::evaluate(StatementIndex stmt)
+{
+    // Static errors are reported the same way as by the tree walker.
+    if (!resolver.resolveVariables(stmt))
+        return false;
+
+    try
+    {
+        const FunctionProto* script = compiler.compileScript(stmt);
+        globals.resize(ctxt.getSymbolCount());
+        defineNatives();
+        run(script);
+        return true;
+    }
+    catch (const CompileTimeError& e)
+    {
+        diag.error(ctxt.getToken(e.where).line, e.message);
+        return false;
+    }
+    catch (const RuntimeError& e)
+    {
+        frames.clear();
+        diag.error(ctxt.getToken(e.where).line, e.message);
+        return false;
+    }
+}
+
+void VM::defineNatives()
+{
+    // Globals are indexed by symbols, so the built in functions are
+    // defined once their names show up in the input.
+    if (nativesDefined)
+        return;
+
+    if (auto symbol = ctxt.findSymbol("clock"))
+    {
+        globals[*symbol] = Value::fromObject(heap.make<ObjNative>(0, clockNative));
+        nativesDefined = true;
+    }
+}
+
+void VM::collect(const Value* top)
+{
+    for (const Value* slot = stack.data(); slot != top; ++slot)
+        heap.mark(*slot);
+    for (auto global : globals)
+        heap.mark(global);
+    for (const auto& frame : frames)
+        heap.mark(frame.closure);
+    heap.collect();
+}
+
+void VM::fail(const std::uint8_t* ip, std::string message) const
+{
+    const Chunk& chunk = frames.back().closure->proto->chunk;
+    throw RuntimeError{chunk.siteBefore(ip - chunk.code.data()), std::move(message)};
+}
+
+void VM::failUndefined(const std::uint8_t* ip) const
+{
+    const Chunk& chunk = frames.back().closure->proto->chunk;
+    auto site = chunk.siteBefore(ip - chunk.code.data());
+    const auto& name = std::get<std::string>(ctxt.getToken(site).value);
+    throw RuntimeError{site, fmt::format("Undefined variable: '{}'.", name)};
+}
+
+#ifdef SLOX_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+void VM::run(const FunctionProto* script)
+{
+    auto* scriptClosure = heap.make<ObjClosure>(script);
+    if (stack.size() < script->maxStack)
+        stack.resize(script->maxStack);
+    stack[0] = Value::fromObject(scriptClosure);
+    frames.push_back({scriptClosure, script->chunk.code.data(), 0});
+
+    // The state of the running frame is kept in locals.
+    ObjClosure* closure;
+    const std::uint8_t* ip;
+    const Value* constants;
+    Value* slots;
+    Value* sp = stack.data() + 1;
+
+#define LOAD_FRAME()                                        \
+    do                                                      \
+    {                                                       \
+        const CallFrame& frame = frames.back();             \
+        closure = frame.closure;                            \
+        ip = frame.ip;                                      \
+        constants = closure->proto->chunk.constants.data(); \
+        slots = stack.data() + frame.base;                  \
+    } while (false)
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, static_cast<std::uint16_t>(ip[-2] | ip[-1] << 8))
+
+#define NUMBER_OPERANDS(op, makeValue)                                 \
+    do                                                                 \
+    {                                                                  \
+        Value right = sp[-1];                                          \
+        Value left = sp[-2];                                           \
+        if (!left.isNumber() || !right.isNumber())                     \
+            fail(ip, "Operand must evaluate to a number.");            \
+        sp[-2] = Value::makeValue(left.asNumber() op right.asNumber()); \
+        --sp;                                                          \
+    } while (false)
+
+    LOAD_FRAME();
+
+#ifdef SLOX_COMPUTED_GOTO
+    static const void* const handlers[] = {
+#define SLOX_OPCODE_LABEL(name) &&op_##name,
+        SLOX_OPCODES(SLOX_OPCODE_LABEL)
+#undef SLOX_OPCODE_LABEL
+    };
+#define DISPATCH() goto *handlers[READ_BYTE()]
+#define CASE(name) op_##name
+    DISPATCH();
+#else
+#define DISPATCH() continue
+#define CASE(name) case OpCode::name
+    for (;;)
+    switch (static_cast<OpCode>(READ_BYTE()))
+    {
+#endif
+
+    CASE(CONSTANT):
+        *sp++ = constants[READ_SHORT()];
+        DISPATCH();
+    CASE(NIL):
+        *sp++ = Value::nil();
+        DISPATCH();
+    CASE(TRUE):
+        *sp++ = Value::fromBool(true);
+        DISPATCH();
+    CASE(FALSE):
+        *sp++ = Value::fromBool(false);
+        DISPATCH();
+    CASE(POP):
+        --sp;
+        DISPATCH();
+    CASE(POPN):
+        sp -= READ_SHORT();
+        DISPATCH();
+
+    CASE(GET_LOCAL):
+        *sp++ = slots[READ_SHORT()];
+        DISPATCH();
+    CASE(SET_LOCAL):
+        slots[READ_SHORT()] = sp[-1];
+        DISPATCH();
+    CASE(GET_CELL):
+        *sp++ = asCell(slots[READ_SHORT()])->value;
+        DISPATCH();
+    CASE(SET_CELL):
+        asCell(slots[READ_SHORT()])->value = sp[-1];
+        DISPATCH();
+    CASE(MAKE_CELL):
+    {
+        Value& slot = slots[READ_SHORT()];
+        slot = Value::fromObject(heap.make<ObjCell>(slot));
+        DISPATCH();
+    }
+    CASE(GET_CAPTURE):
+        *sp++ = closure->captures[READ_SHORT()]->value;
+        DISPATCH();
+    CASE(SET_CAPTURE):
+        closure->captures[READ_SHORT()]->value = sp[-1];
+        DISPATCH();
+    CASE(GET_GLOBAL):
+    {
+        Value value = globals[READ_SHORT()];
+        if (value.isUndefined())
+            failUndefined(ip);
+        *sp++ = value;
+        DISPATCH();
+    }
+    CASE(SET_GLOBAL):
+    {
+        Value& global = globals[READ_SHORT()];
+        if (global.isUndefined())
+            failUndefined(ip);
+        global = sp[-1];
+        DISPATCH();
+    }
+    CASE(DEFINE_GLOBAL):
+        globals[READ_SHORT()] = *--sp;
+        DISPATCH();
+
+    CASE(ADD):
+    {
+        Value right = sp[-1];
+        Value left = sp[-2];
+        if (left.isNumber() && right.isNumber())
+            sp[-2] = Value::fromNumber(left.asNumber() + right.asNumber());
+        else if (kindOf(left) != kindOf(right))
+            fail(ip, "Operands' type mismatch.");
+        else if (kindOf(left) == Kind::String)
+            sp[-2] = Value::fromObject(concatenate(heap, *asString(left), *asString(right)));
+        else
+            fail(ip, "Operands with unsupported type.");
+        --sp;
+        DISPATCH();
+    }
+    CASE(SUBTRACT):
+        NUMBER_OPERANDS(-, fromNumber);
+        DISPATCH();
+    CASE(MULTIPLY):
+        NUMBER_OPERANDS(*, fromNumber);
+        DISPATCH();
+    CASE(DIVIDE):
+        NUMBER_OPERANDS(/, fromNumber);
+        DISPATCH();
+    CASE(GREATER):
+        NUMBER_OPERANDS(>, fromBool);
+        DISPATCH();
+    CASE(GREATER_EQUAL):
+        NUMBER_OPERANDS(>=, fromBool);
+        DISPATCH();
+    CASE(LESS):
+        NUMBER_OPERANDS(<, fromBool);
+        DISPATCH();
+    CASE(LESS_EQUAL):
+        NUMBER_OPERANDS(<=, fromBool);
+        DISPATCH();
+    CASE(EQUAL):
+        sp[-2] = Value::fromBool(sp[-2] == sp[-1]);
+        --sp;
+        DISPATCH();
+    CASE(NOT):
+        sp[-1] = Value::fromBool(!sp[-1].isTruthy());
+        DISPATCH();
+    CASE(NEGATE):
+        if (!sp[-1].isNumber())
+            fail(ip, "Operand must evaluate to a number.");
+        sp[-1] = Value::fromNumber(-sp[-1].asNumber());
+        DISPATCH();
+    CASE(UNSUPPORTED):
+        fail(ip, "Unexpected binary operator.");
+
+    CASE(PRINT):
+        diag.getOutput() << print(*--sp) << '\n';
+        DISPATCH();
+    CASE(JUMP):
+    {
+        auto offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
+    }
+    CASE(JUMP_IF_FALSE):
+    {
+        auto offset = READ_SHORT();
+        if (!sp[-1].isTruthy())
+            ip += offset;
+        DISPATCH();
+    }
+    CASE(JUMP_IF_TRUE):
+    {
+        auto offset = READ_SHORT();
+        if (sp[-1].isTruthy())
+            ip += offset;
+        DISPATCH();
+    }
+    CASE(POP_JUMP_IF_FALSE):
+    {
+        auto offset = READ_SHORT();
+        if (!(*--sp).isTruthy())
+            ip += offset;
+        DISPATCH();
+    }
+    CASE(LOOP):
+    {
+        auto offset = READ_SHORT();
+        ip -= offset;
+        // Every live value is in a root between the statements.
+        if (heap.shouldCollect())
+            collect(sp);
+        DISPATCH();
+    }
+
+    CASE(CHECK_CALL):
+    {
+        unsigned argCount = READ_BYTE();
+        Value callee = sp[-1];
+        unsigned arity;
+        if (callee.isObject(ObjType::Closure))
+            arity = static_cast<ObjClosure*>(callee.asObject())->proto->arity;
+        else if (callee.isObject(ObjType::Native))
+            arity = static_cast<ObjNative*>(callee.asObject())->arity;
+        else
+            fail(ip, "Can only call functions and classes.");
+
+        if (arity != argCount)
+            fail(ip, fmt::format("Expected {} arguments but got {}.", arity, argCount));
+        DISPATCH();
+    }
+    CASE(CALL):
+    {
+        unsigned argCount = READ_BYTE();
+        if (heap.shouldCollect())
+            collect(sp);
+
+        Value* calleeSlot = sp - argCount - 1;
+        if (calleeSlot->isObject(ObjType::Native))
+        {
+            Value result = static_cast<ObjNative*>(calleeSlot->asObject())->fn(calleeSlot + 1);
+            sp = calleeSlot;
+            *sp++ = result;
+            DISPATCH();
+        }
+
+        if (frames.size() == maxFrames)
+            fail(ip, "Stack overflow.");
+
+        auto* callee = static_cast<ObjClosure*>(calleeSlot->asObject());
+        std::size_t base = calleeSlot - stack.data();
+        if (std::size_t needed = base + callee->proto->maxStack; needed > stack.size())
+        {
+            std::size_t top = sp - stack.data();
+            stack.resize(std::max(needed, 2 * stack.size()));
+            sp = stack.data() + top;
+        }
+
+        frames.back().ip = ip;
+        frames.push_back({callee, callee->proto->chunk.code.data(), base});
+        LOAD_FRAME();
+        DISPATCH();
+    }
+    CASE(CLOSURE):
+    {
+        const FunctionProto* proto = closure->proto->chunk.functions[READ_SHORT()];
+        auto* result = heap.make<ObjClosure>(proto);
+        result->captures.reserve(proto->captures.size());
+        for (auto capture : proto->captures)
+            result->captures.push_back(capture.fromLocal ? asCell(slots[capture.index])
+                                                         : closure->captures[capture.index]);
+        *sp++ = Value::fromObject(result);
+        DISPATCH();
+    }
+    CASE(RET):
+    {
+        Value result = *--sp;
+        std::size_t base = frames.back().base;
+        frames.pop_back();
+        if (frames.empty())
+            return;
+
+        sp = stack.data() + base;
+        *sp++ = result;
+        LOAD_FRAME();
+        DISPATCH();
+    }
+
+#ifndef SLOX_COMPUTED_GOTO
+    }
+#endif
+
+#undef CASE
+#undef DISPATCH
+#undef NUMBER_OPERANDS
+#undef READ_SHORT
+#undef READ_BYTE
+#undef LOAD_FRAME
+}
+
+#ifdef SLOX_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
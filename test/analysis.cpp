@@ -0,0 +1,135 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <optional>
+#include <string>
+#include <sstream>
+#include <vector>
+
+#include "include/analysis.h"
+#include "include/lexer.h"
+#include "include/parser.h"
+
+namespace
+{
+
+// Returns the operand types of the binary operators in the order
+// the parser created them.
+std::optional<std::vector<StaticType>> binaryOperandTypes(std::string sourceCode)
+{
+    std::stringstream output;
+    DiagnosticEmitter emitter(output, output);
+    Lexer lexer(std::move(sourceCode), emitter);
+    auto maybeTokens = lexer.lexAll();
+    if (!maybeTokens)
+        return std::nullopt;
+
+    Parser parser(emitter);
+    parser.addTokens(std::move(*maybeTokens));
+    auto maybeAst = parser.parse();
+    if (!maybeAst)
+        return std::nullopt;
+
+    TypeInference inference(parser.getContext());
+    auto facts = inference.inferTypes(*maybeAst);
+
+    std::vector<StaticType> result;
+    for (unsigned id = 0; facts.operandsOf(Index<Binary>{id}) != StaticType::None; ++id)
+        result.push_back(facts.operandsOf(Index<Binary>{id}));
+    return result;
+}
+
+TEST(Analysis, TypeInference)
+{
+    using enum StaticType;
+    std::pair<std::string_view, std::vector<StaticType>> checks[] =
+    {
+        // Globals are not tracked.
+        {"var a = 1; print a + 1;", {Unknown}},
+        // Literals and locals.
+        {"{ var a = 1; print a + 1; }", {Number}},
+        {"{ var a = \"a\"; print a + \"b\"; }", {String}},
+        {"{ var a = 1; print a + \"b\"; }", {Unknown}},
+        // Results of operators.
+        {"{ var a = 1 * 2; var b = a < 3; print b == true; }", {Number, Number, Bool}},
+        // Joins.
+        {"{ var a = 1; if (a < 2) a = \"a\"; print a + 1; }", {Number, Unknown}},
+        {"{ var a = 1; if (a < 2) a = 2; else a = 3; print a + 1; }", {Number, Number}},
+        // Loops.
+        {"for (var i = 0; i < 10; i = i + 1) print i;", {Number, Number}},
+        {"{ var a = 1; while (true) { print a - 1; a = nil; } }", {Unknown}},
+        // Parameters are refined by successful operations.
+        {"fun f(n) { if (n < 2) return n; return n - 1 + n - 2; }", {Unknown, Number, Number, Number}},
+        // Assignments in the right operand invalidate the left one.
+        {"fun f(x) { if (x < (x = \"a\")) return x - 1; }", {Unknown, Unknown}},
+        {"fun g(v) { return 5; } fun f(x) { if (x < g(x = \"a\")) return x - 1; }", {Unknown, Unknown}},
+        {"fun f(x) { if (x < ((x = \"a\") and 5)) return x - 1; }", {Unknown, Unknown, Unknown}},
+        // Locals written by nested functions.
+        {"fun f() { var a = 1; fun g() { a = nil; } g(); print a + 1; }", {Unknown}},
+        // Short circuiting operators.
+        {"fun f(x) { var a = 1; true or (a = nil); print a + x; }", {Unknown, Unknown}},
+    };
+
+    for (const auto& [code, expected] : checks)
+    {
+        auto types = binaryOperandTypes(std::string(code));
+        ASSERT_TRUE(types.has_value());
+        EXPECT_EQ(*types, expected) << code;
+    }
+}
+
+std::optional<std::vector<std::string>> pureFunctions(std::string sourceCode)
+{
+    std::stringstream output;
+    DiagnosticEmitter emitter(output, output);
+    Lexer lexer(std::move(sourceCode), emitter);
+    auto maybeTokens = lexer.lexAll();
+    if (!maybeTokens)
+        return std::nullopt;
+
+    Parser parser(emitter);
+    parser.addTokens(std::move(*maybeTokens));
+    auto maybeAst = parser.parse();
+    if (!maybeAst)
+        return std::nullopt;
+
+    PurityAnalysis purity(parser.getContext());
+    std::vector<std::string> result;
+    for (auto name : purity.findPureFunctions(*maybeAst))
+        result.push_back(std::get<std::string>(parser.getContext().getToken(name).value));
+    std::ranges::sort(result);
+    return result;
+}
+
+TEST(Analysis, Purity)
+{
+    using Names = std::vector<std::string>;
+    std::pair<std::string_view, Names> checks[] =
+    {
+        {"fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }", {"fib"}},
+        {"fun f(a, b) { var c = a; while (c < b) c = c + 1; return c; }", {"f"}},
+        // Immutable globals can be read.
+        {"var k = 2; fun f(x) { return k * x; }", {"f"}},
+        {"var k = 2; fun f(x) { return k * x; } k = 3;", {}},
+        {"var k = 2; var k = 3; fun f(x) { return k * x; }", {}},
+        // Side effects.
+        {"fun f(x) { print x; }", {}},
+        {"var a = 1; fun f(x) { a = x; }", {}},
+        {"fun f() { return clock(); }", {}},
+        {"fun f() { fun g() {} return g; }", {}},
+        // Callees have to be pure.
+        {"fun f(x) { return g(x); } fun g(x) { return x; }", {"f", "g"}},
+        {"fun f(x) { return g(x); } fun g(x) { print x; }", {}},
+        {"fun f(g) { return g(); }", {}},
+        {"fun f() { return 1; } fun g() { return f(); } f = nil;", {}},
+    };
+
+    for (const auto& [code, expected] : checks)
+    {
+        auto names = pureFunctions(std::string(code));
+        ASSERT_TRUE(names.has_value());
+        EXPECT_EQ(*names, expected) << code;
+    }
+}
+
+} // anonymous namespace
@@ -8,11 +8,12 @@
 #include "include/lexer.h"
 #include "include/parser.h"
 #include "include/interpreter.h"
+#include "include/vm.h"
 
 namespace
 {
 
-std::optional<std::string> evalCode(std::string sourceCode)
+std::optional<std::string> evalCode(std::string sourceCode, const Options& options = {})
 {
     std::stringstream output;
     DiagnosticEmitter emitter(output, output);
@@ -27,20 +28,42 @@ std::optional<std::string> evalCode(std::string sourceCode)
     if (!maybeAst)
         return std::nullopt;
 
-    Interpreter interpreter(parser.getContext(), emitter);
-    interpreter.evaluate(*maybeAst);
+    if (options.engine == Engine::VM)
+    {
+        VM vm(parser.getContext(), emitter, options.maxCallDepth);
+        vm.evaluate(*maybeAst);
+    }
+    else
+    {
+        Interpreter interpreter(parser.getContext(), emitter, options);
+        interpreter.evaluate(*maybeAst);
+    }
 
     return std::move(output).str();
 }
 
-void checkOutputOfCode(std::string_view code, std::string_view expectedOutput)
+void checkOutputOfCode(std::string_view code, std::string_view expectedOutput, const Options& options = {})
 {
-    auto output = evalCode(std::string(code));
+    auto output = evalCode(std::string(code), options);
     EXPECT_TRUE(output.has_value());
     EXPECT_EQ(*output, expectedOutput);
 }
 
-TEST(Eval, BasicNodes)
+// The engines have to produce the same output.
+class EvalEngine : public ::testing::TestWithParam<Engine>
+{
+protected:
+    Options options() const
+    {
+        Options result;
+        result.engine = GetParam();
+        return result;
+    }
+};
+
+INSTANTIATE_TEST_SUITE_P(Engines, EvalEngine, ::testing::Values(Engine::TreeWalker, Engine::Closures, Engine::VM));
+
+TEST_P(EvalEngine, BasicNodes)
 {
     std::pair<std::string_view, std::string_view> checks[] =
     {
@@ -62,6 +85,10 @@ TEST(Eval, BasicNodes)
         {"print false or 5;", "5\n"},
         {"print true and nil;", "nil\n"},
         {R"(print "Hello " + "world!";)", "Hello world!\n"},
+        // Operands of statically known types.
+        {"{ var a = 2; var b = 4; print -a * b - b / a; print a < b; }", "-10\ntrue\n"},
+        {"{ var a = 2; var b = 4; print a == b; }", "false\n"},
+        {R"({ var a = "Hello "; print a + "world!"; })", "Hello world!\n"},
 
         // Assignment.
         {"var a = 1; print a;", "1\n"},
@@ -82,7 +109,7 @@ TEST(Eval, BasicNodes)
     };
 
     for (auto check : checks)
-        checkOutputOfCode(check.first, check.second);
+        checkOutputOfCode(check.first, check.second, options());
 
     // Retest everything in incremental mode,
     // i.e., parsing line by line.
@@ -96,24 +123,52 @@ TEST(Eval, BasicNodes)
     }
     std::stringstream input(allCode);
     std::stringstream output;
-    runPrompt(input, output, output);
+    runPrompt(input, output, output, options());
     EXPECT_EQ(std::move(output).str(), allExpectedOutput);
 }
 
-TEST(Eval, StaticErrors)
+TEST_P(EvalEngine, StaticErrors)
 {
     std::pair<std::string_view, std::string_view> checks[] =
     {
         {"return;", "[line 1] Error : Can't return from top level code\n"},
         {"fun f() { var a = 1; var a = 1; }", "[line 1] Error : Already a variable with name 'a' in this scope.\n"},
         {"fun f() { var a = a; }", "[line 1] Error : Can't read local variable in its own initializer.\n"},
+        {"fun f(a) { { var a = 1; } var a = 2; }", "[line 1] Error : Already a variable with name 'a' in this scope.\n"},
+        {"{ var a = 1; { var a = a; } }", "[line 1] Error : Can't read local variable in its own initializer.\n"},
+        // Constants.
+        {"const a = 1; a = 2;", "[line 1] Error : Can't assign to constant 'a'.\n"},
+        {"{ const a = 1; { a = 2; } }", "[line 1] Error : Can't assign to constant 'a'.\n"},
+        {"fun f() { a = 2; } const a = 1;", "[line 1] Error : Can't assign to constant 'a'.\n"},
+        {"const a = 1; var a = 2;", "[line 1] Error : Already a variable with name 'a' in this scope.\n"},
+        {"var a = 1; const a = 2;", "[line 1] Error : Already a variable with name 'a' in this scope.\n"},
     };
 
     for (auto check : checks)
-        checkOutputOfCode(check.first, check.second);
+        checkOutputOfCode(check.first, check.second, options());
 }
 
-TEST(Eval, RuntimeErrors)
+TEST_P(EvalEngine, StaticErrorsInDeadBranches)
+{
+    // The optimizations of runSource prune the branches that cannot run.
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"if (false) return 1;", "[line 1] Error : Can't return from top level code\n"},
+        {"if (false) { var a = 1; var a = 2; }", "[line 1] Error : Already a variable with name 'a' in this scope.\n"},
+        {"while (false) { var a = a; }", "[line 1] Error : Can't read local variable in its own initializer.\n"},
+        {"fun g() { if (false) { var a = a; } }", "[line 1] Error : Can't read local variable in its own initializer.\n"},
+        {"const debug = false; if (debug) print 1; else print 2;", "2\n"},
+    };
+
+    for (auto check : checks)
+    {
+        std::stringstream output;
+        runSource(std::string(check.first), output, output, options());
+        EXPECT_EQ(std::move(output).str(), check.second) << check.first;
+    }
+}
+
+TEST_P(EvalEngine, RuntimeErrors)
 {
     std::pair<std::string_view, std::string_view> checks[] =
     {
@@ -129,13 +184,14 @@ TEST(Eval, RuntimeErrors)
         {"a;", "[line 1] Error : Undefined variable: 'a'.\n"},
         {"a = 1;", "[line 1] Error : Undefined variable: 'a'.\n"},
         {"4(1, 2, 3);", "[line 1] Error : Can only call functions and classes.\n"},
+        {"fun f(a) {} f();", "[line 1] Error : Expected 1 arguments but got 0.\n"},
     };
 
     for (auto check : checks)
-        checkOutputOfCode(check.first, check.second);
+        checkOutputOfCode(check.first, check.second, options());
 }
 
-TEST(Eval, Scoping)
+TEST_P(EvalEngine, Scoping)
 {
     std::pair<std::string_view, std::string_view> checks[] =
     {
@@ -145,6 +201,8 @@ TEST(Eval, Scoping)
         // Shadowing.
         {"var a = 1; { var a = 2; print a; } print a;", "2\n1\n"},
         {"var a = 1; fun f(a){ print a; } f(2);", "2\n"},
+        {"{ var a = 1; { var a = 2; { var a = 3; print a; } print a; } print a; }", "3\n2\n1\n"},
+        {"const a = 1; { var a = 2; a = 3; print a; } print a;", "3\n1\n"},
 
         // Function can modify globals.
         {"var a = 1; fun f() { a = 2; } f(); print a;", "2\n"},
@@ -160,6 +218,11 @@ TEST(Eval, Scoping)
          "}"
          "var c = makeCounter();"
          "c(); c(); c(); c(); c();", "1\n2\n3\n4\n5\n"},
+        {"var f; { var i = 0; while (i < 3) { var j = i; fun g() { print j; } if (i == 1) f = g; i = i + 1; } } f();",
+         "1\n"},
+        {"fun outer() { var a = 1; fun mid() { fun inner() { a = a + 1; return a; } return inner; } return mid(); }"
+         "var q = outer(); q(); print q();", "3\n"},
+        {"{ fun sum(n) { if (n < 1) return 0; return n + sum(n - 1); } print sum(3); }", "6\n"},
 
         // Closure is snapshot.
         {"var global = 1;"
@@ -173,7 +236,294 @@ TEST(Eval, Scoping)
          "}", "1\n1\n"},
     };
 
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options());
+}
+
+TEST_P(EvalEngine, RecursiveClosuresInLoops)
+{
+    // The closures referring to themselves are freed by the engines,
+    // the ones still reachable survive that.
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"var i = 0; var total = 0;"
+         "while (i < 5000) { fun rec(n) { if (n == 0) return 0; return rec(n - 1) + 1; } total = total + rec(3); i = i + 1; }"
+         "print total;", "15000\n"},
+        {"var i = 0; var total = 0;"
+         "while (i < 5000) {"
+         "  var other;"
+         "  fun a(n) { if (n == 0) return 0; return other(n - 1); }"
+         "  fun b(n) { return a(n); }"
+         "  other = b; total = total + a(2); i = i + 1;"
+         "}"
+         "print total;", "0\n"},
+        {"fun make() { fun rec(n) { if (n == 0) return \"done\"; return rec(n - 1); } return rec; }"
+         "var r = make(); var i = 0;"
+         "while (i < 5000) { fun g() { return g; } g(); i = i + 1; }"
+         "print r(10);", "done\n"},
+        {"fun make() { var self; fun get() { return self; } self = get; return get; }"
+         "var f = make(); var i = 0;"
+         "while (i < 5000) { make(); i = i + 1; }"
+         "print f()()() == nil;", "false\n"},
+    };
+
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options());
+}
+
+TEST_P(EvalEngine, ChangingOperandTypes)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"fun add(a, b) { return a + b; } print add(1, 2); print add(\"a\", \"b\"); print add(1, \"b\");",
+         "3\nab\n[line 1] Error : Operands' type mismatch.\n"},
+        {"fun eq(a, b) { return a == b; } print eq(\"a\", \"a\"); print eq(1, 1); print eq(\"a\", 1);",
+         "true\ntrue\nfalse\n"},
+        {"fun lt(a, b) { return a < b; } print lt(1, 2); print lt(\"a\", 2);",
+         "true\n[line 1] Error : Operand must evaluate to a number.\n"},
+        {"fun neg(x) { return -x; } print neg(1); print neg(nil);",
+         "-1\n[line 1] Error : Operand must evaluate to a number.\n"},
+        // The right operand changes the type of the left one.
+        {"fun g(v) { return 5; } fun f(x) { if (x < g(x = \"a\")) { return x - 1; } return 0; } print f(1);",
+         "[line 1] Error : Operand must evaluate to a number.\n"},
+        {"fun f(x) { if (x < ((x = \"a\") and 5)) { return x - 1; } return 0; } print f(1);",
+         "[line 1] Error : Operand must evaluate to a number.\n"},
+    };
+
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options());
+}
+
+TEST_P(EvalEngine, FusedOperands)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"var s = 0; for (var i = 0; i < 5; i = i + 1) s = s + i; print s;", "10\n"},
+        {"fun f(n) { var x = 1; var y = 2; while (x < n) x = x + y; return x; } print f(10);", "11\n"},
+        {"fun f(a, b) { if (a == b) return 1; return 2 < a; } print f(3, 3); print f(3, 4);", "1\ntrue\n"},
+        {"fun f() { var a = 1; { var b = a + 1; return b + a; } } print f();", "3\n"},
+        {"fun f() { return x + 1; } print f();",
+         "[line 1] Error : Undefined variable: 'x'.\n"},
+        {"fun f() { var x; x = y; } f();",
+         "[line 1] Error : Undefined variable: 'y'.\n"},
+    };
+
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options());
+}
+
+TEST_P(EvalEngine, Strings)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"print \"ab\" == \"ab\"; print \"ab\" == \"ba\";", "true\nfalse\n"},
+        {"var a = \"a\"; print a + \"b\" == \"ab\"; print \"ab\" == a + \"b\";", "true\ntrue\n"},
+        {"var a = \"a\"; print a + \"b\" == \"a\" + \"b\"; print a + a == \"ab\";", "true\nfalse\n"},
+        {"fun id(s) { return s; } var s = \"x\"; print id(s) == s; print id(s + s);", "true\nxx\n"},
+        {"var a = \"x\"; a = a + \"y\"; var b = a + \"1\"; var c = a + \"2\"; print b; print c; print a; print b == a + \"1\";",
+         "xy1\nxy2\nxy\ntrue\n"},
+        {"var s = \"\"; var t = s; for (var i = 0; i < 3; i = i + 1) s = s + \"ab\"; print s; print t + \"c\"; print s + s;",
+         "ababab\nc\nabababababab\n"},
+        // Literals appended to in a loop.
+        {"for (var i = 0; i < 3; i = i + 1) { var s = \"a\"; s = s + \"b\"; print s + \"c\"; }", "abc\nabc\nabc\n"},
+    };
+
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options());
+}
+
+TEST_P(EvalEngine, Numbers)
+{
+    // Integral numbers behave exactly like the doubles they stand for.
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"print 0 * -1; print -0 == 0; print 1 / 0; print 7 / 2; print 6 / 3 == 2;", "-0\ntrue\ninf\n3.5\ntrue\n"},
+        {"var big = 562949953421311; print big + 1 - 1 == big; print big * big;",
+         "true\n3.1691265005705622e+29\n"},
+        {"print 9007199254740992 + 1; print 0.5 + 0.5 == 1; print 3 - 0.5 < 3;", "9007199254740992\ntrue\ntrue\n"},
+        {"var s = 0; for (var i = 0; i < 10; i = i + 1) s = s + i * 3 - i; print s;", "90\n"},
+    };
+
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options());
+}
+
+TEST_P(EvalEngine, CallArguments)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"fun add(a, b) { return a + b; } print add(add(1, 2), add(3, add(4, 5)));", "15\n"},
+        // Closures passed as arguments survive the calls evaluating the other arguments.
+        {"fun make(n) { fun f() { return n; } return f; } fun id(x) { return x; } "
+         "fun apply(f, x) { return f() + x; } var s = 0; "
+         "for (var i = 0; i < 50; i = i + 1) s = s + apply(make(i), id(id(id(1)))); print s;", "1275\n"},
+        {"fun f(a, b) { return a; } fun g() { return f(1, nil + 1); } print g();",
+         "[line 1] Error : Operands' type mismatch.\n"},
+    };
+
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options());
+}
+
+TEST_P(EvalEngine, ChangingCallees)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"fun one(a) { return a; } fun two(a, b) { return a + b; } var f = one; "
+         "print f(1); f = two; print f(1, 2); f = one; print f(3); f = two; print f(1);",
+         "1\n3\n3\n[line 1] Error : Expected 2 arguments but got 1.\n"},
+        {"var a = 1; fun get() { return a; } print get(); var a = 2; print get(); a = 3; print get();",
+         "1\n2\n3\n"},
+    };
+
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options());
+}
+
+TEST_P(EvalEngine, Returns)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"fun f() { while (true) { { if (true) return 1; } } } print f();", "1\n"},
+        {"fun f(n) { for (var i = 0; i < 10; i = i + 1) { if (i == n) return i; } } print f(3); print f(20);",
+         "3\nnil\n"},
+        {"fun f() { return; } print f();", "nil\n"},
+        {"fun f(n) { { var a = n; { return a; } } } print f(1) + f(2);", "3\n"},
+    };
+
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options());
+}
+
+TEST_P(EvalEngine, CallDepth)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"fun deep(n) { if (n == 0) return 0; return deep(n - 1) + 1; } print deep(50);", "50\n"},
+        {"fun deep(n) { if (n == 0) return 0; return deep(n - 1) + 1; } print deep(51);",
+         "[line 1] Error : Stack overflow.\n"},
+        {"fun f() { f(); } f();", "[line 1] Error : Stack overflow.\n"},
+    };
+
+    Options limited = options();
+    limited.maxCallDepth = 51;
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, limited);
+}
+
+TEST(Eval, NativeStack)
+{
+    // The tree walker and the closures report running out of the
+    // native stack instead of crashing, whatever the frames take. The
+    // depth they reach depends on the size of the stack and the build.
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"fun deep(n) { if (n == 0) return 0; return deep(n - 1) + 1; } print deep(100);", "100\n"},
+        {"fun deep(n) { if (n == 0) return 0; return deep(n - 1) + 1; } print deep(1000000);",
+         "[line 1] Error : Stack overflow.\n"},
+        {"fun deep(n) { if (n == 0) return 0; { var a = 1; return 1 + (a + (1 + deep(n - 1))); } } print deep(1000000);",
+         "[line 1] Error : Stack overflow.\n"},
+    };
+
+    for (auto engine : {Engine::TreeWalker, Engine::Closures})
+    {
+        Options options;
+        options.engine = engine;
+        options.maxCallDepth = maxNativeCallDepth();
+        for (auto check : checks)
+            checkOutputOfCode(check.first, check.second, options);
+    }
+}
+
+TEST(Eval, DeepRecursion)
+{
+    // Frames of the VM do not live on the native stack.
+    Options options;
+    options.engine = Engine::VM;
+    checkOutputOfCode("fun deep(n) { if (n == 0) return 0; return deep(n - 1) + 1; } print deep(1000000);",
+                      "1000000\n", options);
+}
+
+TEST(Eval, TailCalls)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        // Deeper than the native stack allows.
+        {"fun isEven(n) { if (n == 0) return true; return isOdd(n - 1); }"
+         "fun isOdd(n) { if (n == 0) return false; return isEven(n - 1); }"
+         "print isEven(100001);", "false\n"},
+        {"fun count(n, acc) { { var m = n - 1; if (n == 0) return acc; return count(m, acc + 1); } }"
+         "print count(100000, 0);", "100000\n"},
+        // Closures stay alive after the frame is reused.
+        {"fun make(n) { fun get() { return n; } return id(get); } fun id(f) { return f; }"
+         "var g = make(3); print g();", "3\n"},
+        {"fun f() { return clock() > 0; } print f();", "true\n"},
+        {"fun f(a) { return g(a); } fun g(a, b) { return a; } f(1);",
+         "[line 1] Error : Expected 2 arguments but got 1.\n"},
+    };
+
     for (auto check : checks)
         checkOutputOfCode(check.first, check.second);
 }
-} // anonymous namespace
\ No newline at end of file
+
+TEST(Eval, MemoizePure)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        // Would not finish without memoization.
+        {"fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } print fib(70);", "190392490709135\n"},
+        // Arguments that cannot be cached.
+        {"fun f(g) { return 1; } fun g() {} print f(g); print f(g);", "1\n1\n"},
+        // Zero and negative zero are different arguments.
+        {"fun inv(x) { return 1 / x; } print inv(0); print inv(-0);", "inf\n-inf\n"},
+        // Errors are not cached.
+        {"fun f(x) { return x - 1; } print f(1); print f(\"a\");", "0\n[line 1] Error : Operand must evaluate to a number.\n"},
+    };
+
+    Options options;
+    options.memoizePure = true;
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options);
+}
+
+TEST(Eval, MemoizedTailCalls)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        {"fun isEven(n) { if (n == 0) return true; return isOdd(n - 1); }"
+         "fun isOdd(n) { if (n == 0) return false; return isEven(n - 1); }"
+         "print isEven(1000000); print isOdd(1001); print isEven(1000);", "true\ntrue\ntrue\n"},
+        // Later chains stop at the results cached by the earlier ones.
+        {"fun count(n, acc) { if (n == 0) return acc; return count(n - 1, acc + 1); }"
+         "print count(100000, 0); print count(1000, 0); print count(0, 5);", "100000\n1000\n5\n"},
+    };
+
+    Options options;
+    options.memoizePure = true;
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options);
+}
+
+TEST(Eval, LazyResolve)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        // Bodies are resolved on the first call.
+        {"fun f() { var a = 1; var a = 2; } print 1;", "1\n"},
+        {"fun f() { var a = 1; var a = 2; } print 1; f();",
+         "1\n[line 1] Error : Already a variable with name 'a' in this scope.\n"},
+        // Locals and closures in the deferred bodies.
+        {"fun f(n) { var a = n; { var a = 2; } return a; } print f(1); print f(3);", "1\n3\n"},
+        {"fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } print fib(10);", "55\n"},
+        {"fun make() { var i = 0; fun inc() { i = i + 1; return i; } return inc; } var c = make(); c(); print c();", "2\n"},
+        // Functions in blocks are resolved eagerly.
+        {"{ fun f() { var a = 1; var a = 2; } } print 1;",
+         "[line 1] Error : Already a variable with name 'a' in this scope.\n"},
+    };
+
+    Options options;
+    options.lazyResolve = true;
+    for (auto check : checks)
+        checkOutputOfCode(check.first, check.second, options);
+}
+} // anonymous namespace
@@ -48,10 +48,10 @@ TEST(Lexer, TestAllTokens)
     // Keywords.
     {
         std::stringstream output;
-        auto tokenList = lexString("and class else false fun for if nil or"
+        auto tokenList = lexString("and class const else false fun for if nil or"
                                    " print return super this true var while", output).value();
         auto sourceTokens = tokenList.getSourceTokens();
-        TokenType tokenTypes[] = {AND, CLASS, ELSE, FALSE, FUN, FOR, IF, NIL,
+        TokenType tokenTypes[] = {AND, CLASS, CONST, ELSE, FALSE, FUN, FOR, IF, NIL,
                                   OR, PRINT, RET, SUPER, THIS, TRUE, VAR, WHILE,
                                   END_OF_FILE};
         EXPECT_TRUE(std::equal(sourceTokens.begin(), sourceTokens.end(), std::begin(tokenTypes), std::end(tokenTypes),
@@ -0,0 +1,246 @@
+#include <gtest/gtest.h>
+
+#include <optional>
+#include <string>
+#include <sstream>
+
+#include "include/eval.h"
+#include "include/lexer.h"
+#include "include/parser.h"
+#include "include/optimizer.h"
+
+namespace
+{
+
+struct OptimizeResult
+{
+    std::string dumped;
+    std::string output;
+};
+
+template<typename Pass>
+std::optional<OptimizeResult> optimizeCode(std::string sourceCode, Pass pass)
+{
+    std::stringstream output;
+    DiagnosticEmitter emitter(output, output);
+    Lexer lexer(std::move(sourceCode), emitter);
+    auto maybeTokens = lexer.lexAll();
+    if (!maybeTokens)
+        return std::nullopt;
+
+    Parser parser(emitter);
+    parser.addTokens(std::move(*maybeTokens));
+    auto maybeAst = parser.parse();
+    if (!maybeAst)
+        return std::nullopt;
+
+    auto unit = pass(parser.getContext(), *maybeAst);
+    ASTPrinter printer(parser.getContext());
+    std::string dumped = printer.print(unit);
+
+    Interpreter interpreter(parser.getContext(), emitter);
+    interpreter.evaluate(unit);
+
+    return OptimizeResult{std::move(dumped), std::move(output).str()};
+}
+
+TEST(Optimizer, Inlining)
+{
+    struct
+    {
+        std::string_view code;
+        std::string_view inlinedCall;
+        std::string_view output;
+    } checks[] =
+    {
+        // Arguments are substituted for the parameters.
+        {"fun sq(x) { return x * x; } var a = 3; print sq(a);", "(print (* a a))", "9\n"},
+        {"fun add(x, y) { return x + y; } { var a = 1; print add(a, 2); }", "(print (+ a 2.000000))", "3\n"},
+        // Globals of the callee are kept.
+        {"var k = 2; fun mul(x) { return k * x; } print mul(4);", "(print (* k 4.000000))", "8\n"},
+        // Calls in the body are fine with literal arguments.
+        {"fun one() { return 1; } fun inc(x) { return x + one(); } print inc(1);", "(print (+ 1.000000 (call one)))", "2\n"},
+    };
+
+    for (auto check : checks)
+    {
+        auto result = optimizeCode(std::string(check.code), inlineCalls);
+        ASSERT_TRUE(result.has_value());
+        EXPECT_NE(result->dumped.find(check.inlinedCall), std::string::npos) << result->dumped;
+        EXPECT_EQ(result->output, check.output);
+    }
+}
+
+TEST(Optimizer, InliningPreservesSemantics)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        // Recursive functions.
+        {"fun f(n) { return n < 1 or f(n - 1); } print f(3);", "true\n"},
+        // Reassigned functions.
+        {"fun f() { return 1; } fun g() { return 2; } f = g; print f();", "2\n"},
+        // Calls before the declaration.
+        {"print f(); fun f() { return 1; }", "[line 1] Error : Undefined variable: 'f'.\n"},
+        // Shadowed callee.
+        {"fun f() { return 1; } { fun f() { return 2; } print f(); }", "2\n"},
+        // Shadowed global in the callee.
+        {"var k = 1; fun f() { return k; } { var k = 2; print f(); }", "1\n"},
+        // Arguments with side effects.
+        {"var a = 0; fun f(x, y) { return y; } fun g() { a = a + 1; return a; } print f(g(), 5); print a;", "5\n1\n"},
+        // Wrong number of arguments.
+        {"fun f(x) { return x; } print f();", "[line 1] Error : Expected 1 arguments but got 0.\n"},
+        // Variables might be changed by the calls in the body.
+        {"var a = 1; fun set() { a = 2; return 0; } fun f(x) { return set() + x; } print f(a);", "1\n"},
+    };
+
+    for (auto [code, expected] : checks)
+    {
+        auto result = optimizeCode(std::string(code), inlineCalls);
+        ASSERT_TRUE(result.has_value());
+        EXPECT_EQ(result->output, expected) << code;
+    }
+}
+
+TEST(Optimizer, LoopInvariantMotion)
+{
+    struct
+    {
+        std::string_view code;
+        std::string_view hoisted;
+        std::string_view output;
+    } checks[] =
+    {
+        {"{ var n = 3; var i = 0; while (i < n * 2) i = i + 1; print i; }",
+         "(var $licm0 (* n 2.000000))", "6\n"},
+        // Loops desugared from for statements.
+        {"fun f(a, b) { a = a + 0; b = b + 0; for (var i = 0; i < 3; i = i + 1) print a * b + i; } f(2, 3);",
+         "(var $licm0 (* a b))", "6\n7\n8\n"},
+        // Expressions invariant in nested loops are hoisted out of all of them.
+        {"{ var n = 2; var i = 0; while (i < 2) { var j = 0; while (j < -n) j = j + 1; i = i + 1; } print i; }",
+         "(var $licm0 (- n))", "2\n"},
+        // Parameters and globals of unknown types are computed on first use.
+        {"fun f(n) { var i = 0; while (i < n * 2) i = i + 1; print i; } f(3);",
+         "(or $licm0 (= $licm0 (* n 2.000000)))", "6\n"},
+        {"var n = 3; var i = 0; while (i < n * 2) i = i + 1; print i;",
+         "(or $licm0 (= $licm0 (* n 2.000000)))", "6\n"},
+        // Operators that cannot fail do not need types.
+        {"fun f(x) { var i = 0; while (i < 2) { print x == nil; i = i + 1; } } f(nil);",
+         "(var $licm0 (== x nil))", "true\ntrue\n"},
+    };
+
+    for (auto check : checks)
+    {
+        auto result = optimizeCode(std::string(check.code), hoistLoopInvariants);
+        ASSERT_TRUE(result.has_value());
+        EXPECT_NE(result->dumped.find(check.hoisted), std::string::npos) << result->dumped;
+        EXPECT_EQ(result->output, check.output);
+    }
+}
+
+TEST(Optimizer, LoopInvariantMotionPreservesSemantics)
+{
+    std::pair<std::string_view, std::string_view> checks[] =
+    {
+        // Variables written in the loop.
+        {"{ var n = 1; var i = 0; while (i < 3) { print n * 2; n = n + 1; i = i + 1; } }", "2\n4\n6\n"},
+        // Operations that might fail are not evaluated before the loop.
+        {"fun f(n) { var i = 0; while (i < 0) print n * 2; print \"done\"; } f(\"a\");", "done\n"},
+        {"fun f(n) { var i = 0; while (i < 1) { print \"first\"; print n - 1; i = i + 1; } } f(nil);",
+         "first\n[line 1] Error : Operand must evaluate to a number.\n"},
+        {"fun f(n) { var i = 0; while (i < 2) { if (i == 1) print n - 1; i = i + 1; } print \"done\"; } f(nil);",
+         "[line 1] Error : Operand must evaluate to a number.\n"},
+        {"var s = \"a\"; var i = 0; while (i < 2) { print i; print s * 2; i = i + 1; }",
+         "0\n[line 1] Error : Operand must evaluate to a number.\n"},
+        // Locals written by closures called in the loop.
+        {"{ var a = 1; fun set() { a = a + 1; } var i = 0; while (i < 2) { print a * 2; set(); i = i + 1; } }",
+         "2\n4\n"},
+        // Globals might be changed by the callees.
+        {"var g = 1; fun set() { g = 2; } { var i = 0; while (i < 2) { print g == 1; set(); i = i + 1; } }",
+         "true\nfalse\n"},
+    };
+
+    for (auto [code, expected] : checks)
+    {
+        auto result = optimizeCode(std::string(code), hoistLoopInvariants);
+        ASSERT_TRUE(result.has_value());
+        EXPECT_EQ(result->output, expected) << code;
+    }
+}
+
+TEST(Optimizer, ConstantPropagation)
+{
+    struct
+    {
+        std::string_view code;
+        std::string_view dumped;
+        std::string_view output;
+    } checks[] =
+    {
+        {"const n = 2; print n * 3;", "(unit (const n 2.000000) (print 6.000000))", "6\n"},
+        {"const a = \"a\"; const b = a + \"b\"; print b;",
+         "(unit (const a \"a\") (const b \"ab\") (print \"ab\"))", "ab\n"},
+        {"{ const n = -1; fun f() { return n < 0; } print f(); }",
+         "(unit (block (const n -1.000000) (fun f (body (return true))) (print (call f))))", "true\n"},
+        // Shadowed constants.
+        {"const n = 1; { var n = 2; print n; }", "(unit (const n 1.000000) (block (var n 2.000000) (print n)))", "2\n"},
+        // Operations that fail at runtime are not folded.
+        {"const s = \"a\"; print s - 1;", "(unit (const s \"a\") (print (- \"a\" 1.000000)))",
+         "[line 1] Error : Operand must evaluate to a number.\n"},
+        // References before the declaration.
+        {"fun f() { return n; } const n = 1; print f();",
+         "(unit (fun f (body (return n))) (const n 1.000000) (print (call f)))", "1\n"},
+    };
+
+    for (auto check : checks)
+    {
+        auto result = optimizeCode(std::string(check.code), [](ASTContext& ctxt, Index<Unit> unit) {
+            return propagateConstants(ctxt, unit);
+        });
+        ASSERT_TRUE(result.has_value());
+        EXPECT_EQ(result->dumped, check.dumped);
+        EXPECT_EQ(result->output, check.output);
+    }
+}
+
+TEST(Optimizer, Specialization)
+{
+    struct
+    {
+        std::string_view code;
+        std::string_view dumped;
+        std::string_view output;
+    } checks[] =
+    {
+        // Branches on the literal arguments are pruned.
+        {"fun step(x, n) { if (n == 1) return x; return x * n; } var y = 2; print step(y, 3);",
+         "(unit (fun step x n (body (if (== n 1.000000) (return x) <NULL>) (return (* x n)))) "
+         "(fun step$1 x (body (block) (return (* x 3.000000)))) (var y 2.000000) (print (call step$1 y)))", "6\n"},
+        // Equal arguments share the clone, recursive calls are redirected too.
+        {"fun f(n, s) { if (n < 1) return s; return f(n - 1, s); } var k = 3; print f(k, \"a\"); print f(k, \"a\");",
+         "(unit (fun f n s (body (if (< n 1.000000) (return s) <NULL>) (return (call f (- n 1.000000) s)))) "
+         "(fun f$1 n (body (if (< n 1.000000) (return \"a\") <NULL>) (return (call f$1 (- n 1.000000))))) "
+         "(var k 3.000000) (print (call f$1 k)) (print (call f$1 k)))", "a\na\n"},
+        // Assigned parameters.
+        {"fun f(n) { n = n + 1; return n; } print f(1);",
+         "(unit (fun f n (body (exprStmt (= n (+ n 1.000000))) (return n))) (print (call f 1.000000)))", "2\n"},
+        // Calls before the declaration.
+        {"print f(1); fun f(n) { return n; }",
+         "(unit (print (call f 1.000000)) (fun f n (body (return n))))", "[line 1] Error : Undefined variable: 'f'.\n"},
+        // Shadowed parameters in the clone.
+        {"fun f(n) { { var n = 2; print n; } return n; } print f(1);",
+         "(unit (fun f n (body (block (var n 2.000000) (print n)) (return n))) "
+         "(fun f$1 (body (block (var n 2.000000) (print n)) (return 1.000000))) (print (call f$1)))", "2\n1\n"},
+    };
+
+    for (auto check : checks)
+    {
+        auto result = optimizeCode(std::string(check.code), [](ASTContext& ctxt, Index<Unit> unit) {
+            return specializeCalls(ctxt, unit);
+        });
+        ASSERT_TRUE(result.has_value());
+        EXPECT_EQ(result->dumped, check.dumped);
+        EXPECT_EQ(result->output, check.output);
+    }
+}
+
+} // anonymous namespace
@@ -83,6 +83,7 @@ TEST(Parser, AllNodesParsed)
         // Expression statements are tested with expressions.
         // Variable declaration.
         {"var a = 1;", "(unit (var a 1.000000))"},
+        {"const a = 1;", "(unit (const a 1.000000))"},
         {"var b;", "(unit (var b <NULL>))"},
         // Function declaration and return statement.
         {"fun bar() { return 5; }", "(unit (fun bar (body (return 5.000000))))"},
@@ -135,6 +136,10 @@ TEST(Parser, ErrorMessages)
         {"var a", "[line 1] Error at end of file: Expect ';' after variable declaration.\n"},
         {"var a = 1", "[line 1] Error at end of file: Expect ';' after variable declaration.\n"},
 
+        // Constant declaration.
+        {"const a;", "[line 1] Error at ';': Expect '=' after constant name.\n"},
+        {"const a = 1", "[line 1] Error at end of file: Expect ';' after constant declaration.\n"},
+
         // For statement.
         {"for", "[line 1] Error at end of file: Expect '(' after for.\n"},
         {"for(x;", "[line 1] Error at end of file: Unexpected token.\n"},